@@ -9,8 +9,8 @@
  * limited by the amount of memory available and serves as the requirement for
  * COSC440 assignment 1 in 2015.
  *
- * Note: multiple devices and concurrent modules are not supported in this
- *       version.
+ * The module creates num_devices independent disks, /dev/asgn10 upwards,
+ * each with its own pages, counters and limits.
  */
 
 /*
@@ -25,446 +25,4221 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/list.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/moduleparam.h>
 #include <asm/uaccess.h>
 #include <linux/slab.h>
 #include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/mman.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/crypto.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
 #include <linux/device.h>
+#include <linux/anon_inodes.h>
+#include <linux/falloc.h>
+#include <linux/capability.h>
+#include <linux/shrinker.h>
+#include <linux/crc32c.h>
+#include <linux/crc32.h>
+#include <linux/highmem.h>
+#include <crypto/hash.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+#include "asgn1_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "asgn1_trace.h"
 
 #define MYDEV_NAME "asgn1"
-#define MYIOC_TYPE 'k'
+
+#define FREE_BATCH 64    /* pages released per call into the page allocator */
+#define FILL_ORDER 4     /* largest block requested when filling holes */
+#define ZBUF_SIZE (2 * PAGE_SIZE) /* room for a page that compresses badly */
+#define DEDUP_BITS 12    /* log2 of the buckets in a store's dedup table */
+#define CHUNK_ORDER (PMD_SHIFT - PAGE_SHIFT) /* order of the chunks of a contig device */
+#define CHUNK_NR (1UL << CHUNK_ORDER)        /* pages in a chunk */
+#define CHUNK_SIZE (PAGE_SIZE << CHUNK_ORDER) /* bytes in a chunk */
+#define SAVE_BATCH 256   /* pages per read or write of a backing file */
+#define SAVE_MAGIC "ASGN1IMG"
+#define SAVE_VERSION 1
+#define DIRTY_TAG 0      /* radix tree tag of pages not yet written behind */
+#define DISCARD_TAG 1    /* radix tree tag of pages the shrinker may drop */
+#define GET_PRIVATE 0x1  /* asgn1_get_page_rcu: a page of our own to map */
+#define GET_NOWAIT 0x2   /* asgn1_get_page_rcu: -EAGAIN rather than decompress */
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Ashley Manson");
 MODULE_DESCRIPTION("COSC440 asgn1");
 
 /**
- * The node structure for the memory page linked list.
- */ 
-typedef struct page_node_rec {
-    struct list_head list;
-    struct page *page;
-} page_node;
+ * The node structure for a memory page, indexed by page number in a store.
+ * Nodes are looked up without locks, so they are only ever freed back to a
+ * SLAB_TYPESAFE_BY_RCU cache, see asgn1_get_page_rcu. A cold page may be
+ * compressed, leaving page NULL and its contents in zdata; both only change
+ * under a range lock covering the page, see asgn1_compress_node. Likewise a
+ * page may be shared with identical pages, see asgn1_dedup_node, or with
+ * snapshots of the store, see asgn1_preserve_node. With checksum set each
+ * page also carries a CRC32C, checked on every read and by the scrubber.
+ */ 
+typedef struct page_node_rec {
+    struct page *page;        /* the page, NULL while compressed */
+    struct dedup_page_rec *dup; /* the entry of a shared page, or NULL if private */
+    void *zdata;              /* the compressed page, or NULL */
+    unsigned int zlen;        /* size of zdata */
+    unsigned long atime;      /* jiffies when last read or written */
+    unsigned long gen;        /* store generation the page was last written in */
+    u32 crc;                  /* CRC32C of the page if checksum, see asgn1_set_crc */
+    bool crc_ok;              /* crc is trusted, false once written through a mapping */
+} page_node;
+
+/**
+ * A page shared by identical pages of a store, found by a hash of its
+ * contents. Each node sharing it holds its own reference to the page, and
+ * the page is never written while shared, see asgn1_unshare_node.
+ */
+typedef struct dedup_page_rec {
+    struct hlist_node hash;   /* in the store's dedup_table */
+    struct page *page;        /* the shared page */
+    u32 key;                  /* hash of its contents */
+    int refs;                 /* nodes sharing the page */
+} dedup_page;
+
+/**
+ * The pages of a device, indexed by page number. A device is emptied by
+ * swapping in a new store, and the old one is freed in the background once
+ * no reader can still be walking it, see free_memory_pages.
+ */
+typedef struct asgn1_store_rec {
+    struct radix_tree_root page_tree; /* page number -> page_node, RCU for readers */
+    struct rcu_work free_work;        /* frees the store once it is detached */
+    atomic_t refs;                    /* the device while attached, and each snapshot */
+    int num_pages;                    /* pages left to free once detached */
+    int minor;                        /* minor of the device, for tracing */
+    struct hlist_head *dedup_table;   /* shared pages by content, NULL unless dedup */
+    spinlock_t dedup_lock;            /* protects dedup_table and the counts below */
+    int dedup_nodes;                  /* nodes sharing a page */
+    int dedup_entries;                /* pages they share */
+    unsigned long gen;                /* generation of pages written now, bumped by each snapshot */
+    struct list_head snapshots;       /* snapshots of the store, newest first */
+} asgn1_store;
+
+/**
+ * A read-only point-in-time copy of a device, read through its own file
+ * descriptor, see asgn1_take_snapshot. Taking one copies nothing: it sees
+ * the pages of its store last written in or before its generation, and a
+ * writer about to change such a page first gives the snapshot a copy of it.
+ * The list and the copies only change under a range lock of the device.
+ */
+typedef struct asgn1_snapshot_rec {
+    struct list_head list;            /* in the store's snapshots */
+    struct radix_tree_root pages;     /* page number -> copy of the page when taken */
+    spinlock_t lock;                  /* protects changes to pages */
+    struct asgn1_dev_t *dev;          /* the device it was taken of */
+    asgn1_store *store;               /* the store it was taken of, held */
+    unsigned long gen;                /* the last generation it sees */
+    size_t data_size;                 /* size of the device when taken */
+} asgn1_snapshot;
+
+/**
+ * The header of a backing file, in its first page. The disk follows from
+ * offset PAGE_SIZE as a plain image, its holes left as holes in the file.
+ */
+typedef struct asgn1_save_hdr_rec {
+    char magic[8];            /* SAVE_MAGIC */
+    __le32 version;           /* SAVE_VERSION */
+    __le32 page_size;         /* PAGE_SIZE of the kernel that saved it */
+    __le64 data_size;         /* data_size of the disk */
+} asgn1_save_hdr;
+
+/**
+ * Scratch space for writing dirty pages behind, see asgn1_flush_batch.
+ */
+typedef struct asgn1_flush_buf_rec {
+    unsigned long index[SAVE_BATCH];  /* page numbers of the dirty pages found */
+    page_node *nodes[SAVE_BATCH];     /* their nodes */
+    struct bio_vec bvec[SAVE_BATCH];  /* their contents, each holding a reference */
+} asgn1_flush_buf;
+
+/**
+ * One slice of a disk being restored by a worker, see asgn1_restore_work.
+ */
+typedef struct asgn1_restore_rec {
+    struct work_struct work;
+    struct asgn1_dev_t *dev;
+    struct file *file;        /* the backing file, shared by the workers */
+    loff_t start;             /* byte range of the disk to restore */
+    loff_t end;
+    int result;               /* 0, or the error that stopped the worker */
+} asgn1_restore;
+
+/**
+ * A byte range [start, end) of the disk held by a writer, see asgn1_lock_range.
+ */
+typedef struct range_lock_rec {
+    struct list_head list;
+    loff_t start;
+    loff_t end;
+} range_lock;
+
+/**
+ * Counters and latency histograms of a device, kept per CPU so the I/O paths
+ * never share a cache line for them. See struct asgn1_stats for each field.
+ */
+typedef struct asgn1_cpu_stats_rec {
+    u64 read_ops;
+    u64 read_bytes;
+    u64 write_ops;
+    u64 write_bytes;
+    u64 pages_alloc;
+    u64 pages_freed;
+    u64 mmap_faults;
+    u64 open_busy;
+    u64 nowait_again;
+    u64 discarded;
+    u64 crc_errors;
+    u64 read_lat[ASGN1_LAT_BUCKETS];
+    u64 write_lat[ASGN1_LAT_BUCKETS];
+    u64 fault_lat[ASGN1_LAT_BUCKETS];
+} asgn1_cpu_stats;
+
+/**
+ * The device structure, one per minor. Each device starts on its own cache
+ * line, and the fields writers hit are kept apart from the range lock so
+ * the disks, and readers and writers of one disk, don't falsely share.
+ */
+typedef struct asgn1_dev_t {
+    dev_t dev;                /* the device */
+    struct cdev cdev;
+    asgn1_store __rcu *store; /* the pages, RCU for readers */
+    spinlock_t lock;          /* protects changes to store, num_pages, data_size and the z counters */
+    int num_pages;            /* number of memory pages this device currently holds */
+    size_t data_size;         /* total data size in this device, RCU for readers */
+    int num_zpages;           /* how many of those pages are compressed */
+    size_t zbytes;            /* total size of the compressed pages */
+    bool contig;              /* filled CHUNK_SIZE chunks at a time, see asgn1_fill_chunk */
+    unsigned long max_pages;  /* pages the device may hold, 0 for no limit, see asgn1_room */
+    int num_discard;          /* pages tagged DISCARD_TAG, under lock */
+    struct list_head ranges ____cacheline_aligned_in_smp; /* byte ranges locked by writers */
+    spinlock_t range_lock;    /* protects ranges */
+    wait_queue_head_t range_wait; /* writers waiting for a range to unlock */
+    atomic_t nprocs ____cacheline_aligned_in_smp; /* number of processes accessing this device */ 
+    atomic_t max_nprocs;      /* max number of processes accessing this device */
+    struct device *device;    /* the udev device node */
+    asgn1_cpu_stats __percpu *stats; /* counters, summed by asgn1_sum_stats */
+    struct delayed_work compress_work; /* compresses cold pages, see asgn1_compress_work */
+    struct blk_mq_tag_set tag_set; /* the block front end, see asgn1_queue_rq */
+    struct gendisk *disk;     /* the block device, or NULL */
+    struct file *wb_file;     /* backing file written behind, or NULL, see asgn1_flush */
+    struct address_space mapping; /* shared by every open of the device, see asgn1_open */
+    struct mutex wb_mutex;    /* serialises flushes and protects the flush counters */
+    bool wb_truncated;        /* the store was swapped since the last flush, under lock */
+    int num_dirty;            /* pages tagged DIRTY_TAG, under lock */
+    u64 flushed_bytes;        /* bytes written behind so far */
+    u64 flush_ns;             /* time spent writing them */
+    struct delayed_work flush_work; /* writes dirty pages behind every flush_secs */
+    struct delayed_work scrub_work; /* checks every page every scrub_secs, see asgn1_scrub_work */
+    unsigned long scrub_pos;  /* page the scrubber has reached in this pass */
+    u64 scrub_passes;         /* passes the scrubber has finished */
+    u64 scrub_pages;          /* pages it has checked so far */
+} ____cacheline_aligned_in_smp asgn1_dev;
+
+static asgn1_dev *asgn1_devices;          /* the devices, num_devices of them */
+static struct kmem_cache *asgn1_node_cache; /* page nodes for all devices */
+static struct workqueue_struct *asgn1_free_wq; /* frees detached stores */
+static struct class *asgn1_class;         /* the udev class */
+
+int asgn1_major = 0;     /* major number of module */  
+int asgn1_minor = 0;     /* minor number of module */
+static int asgn1_blk_major; /* major number of the block devices */
+
+static int num_devices = 1; /* number of devices */
+module_param(num_devices, int, S_IRUGO);
+MODULE_PARM_DESC(num_devices, "Number of independent disks to create");
+
+static int max_nprocs = 0; /* initial max number of processes accessing each device, 0 for any */
+module_param(max_nprocs, int, S_IRUGO);
+MODULE_PARM_DESC(max_nprocs, "Initial number of processes allowed to open each device, 0 for no limit");
+
+static int compress_secs = 0; /* idle time before a page is compressed, 0 for never */
+module_param(compress_secs, int, S_IRUGO);
+MODULE_PARM_DESC(compress_secs, "Compress pages not touched for this many seconds, 0 to disable");
+
+static char *compress_alg = "lz4"; /* crypto compression algorithm */
+module_param(compress_alg, charp, S_IRUGO);
+MODULE_PARM_DESC(compress_alg, "Crypto compression algorithm for cold pages, e.g. lz4 or zstd");
+
+static int disk_mib = 0; /* size of the block device of each disk, 0 for none */
+module_param(disk_mib, int, S_IRUGO);
+MODULE_PARM_DESC(disk_mib, "Also make each disk a block device /dev/asgn1bN of this many MiB, 0 for none");
+
+static char *backing = NULL; /* prefix of the files the disks are kept in */
+module_param(backing, charp, S_IRUGO);
+MODULE_PARM_DESC(backing, "Save each disk to <backing>.<N> on unload and restore it from there on load");
+
+static int flush_secs = 0; /* interval between write-behind flushes, 0 for none */
+module_param(flush_secs, int, S_IRUGO);
+MODULE_PARM_DESC(flush_secs, "Write dirty pages behind to the backing file every this many seconds, 0 to only save on unload");
+
+static bool contig = false; /* fill new devices in contiguous chunks */
+module_param(contig, bool, S_IRUGO);
+MODULE_PARM_DESC(contig, "Fill each device with physically contiguous 2 MiB chunks of pages");
+
+static bool dedup = false; /* share identical pages */
+module_param(dedup, bool, S_IRUGO);
+MODULE_PARM_DESC(dedup, "Share one page between identical full pages written");
+
+static unsigned long limit_mib = 0; /* initial limit of each device, 0 for none */
+module_param(limit_mib, ulong, S_IRUGO);
+MODULE_PARM_DESC(limit_mib, "Fail writes with ENOSPC once a disk holds this many MiB, 0 for no limit");
+
+static bool checksum = false; /* keep a CRC32C per page */
+module_param(checksum, bool, S_IRUGO);
+MODULE_PARM_DESC(checksum, "Keep a CRC32C of each page, verified on every read, failing it with EIO");
+
+static int scrub_secs = 0; /* interval between scrubber passes, 0 for none */
+module_param(scrub_secs, int, S_IRUGO);
+MODULE_PARM_DESC(scrub_secs, "With checksum, check every page in the background every this many seconds, 0 to disable");
+
+static u32 asgn1_zero_crc; /* CRC32C of a zeroed page */
+
+static bool shrink = false; /* drop discardable pages under memory pressure */
+module_param(shrink, bool, S_IRUGO);
+MODULE_PARM_DESC(shrink, "Register a shrinker that drops pages marked with ASGN1_DISCARDABLE");
+
+static struct crypto_comp * __percpu *asgn1_tfms; /* one compressor per CPU, as zswap does */
+
+static struct proc_dir_entry *asgn1_proc;
+
+/**
+ * Count n against a statistic of the device on this CPU.
+ */
+#define asgn1_count(dev, field, n) this_cpu_add((dev)->stats->field, (n))
+
+/**
+ * This function returns the latency histogram bucket of a time in ns.
+ */
+static inline unsigned int asgn1_lat_bucket(u64 ns) {
+
+    return ns ? min_t(unsigned int, ilog2(ns), ASGN1_LAT_BUCKETS - 1) : 0;
+}
+
+/**
+ * Record the time since start, from ktime_get_ns, in a latency histogram.
+ */
+#define asgn1_count_lat(dev, hist, start) \
+    this_cpu_inc((dev)->stats->hist[asgn1_lat_bucket(ktime_get_ns() - (start))])
+
+/**
+ * This function totals the per-CPU statistics of a device into stats.
+ */
+static void asgn1_sum_stats(asgn1_dev *dev, struct asgn1_stats *stats) {
+
+    asgn1_cpu_stats *cpu_stats;
+    asgn1_store *store;
+    int cpu, i;
+
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(dev->stats, cpu);
+        stats->read_ops += cpu_stats->read_ops;
+        stats->read_bytes += cpu_stats->read_bytes;
+        stats->write_ops += cpu_stats->write_ops;
+        stats->write_bytes += cpu_stats->write_bytes;
+        stats->pages_alloc += cpu_stats->pages_alloc;
+        stats->pages_freed += cpu_stats->pages_freed;
+        stats->mmap_faults += cpu_stats->mmap_faults;
+        stats->open_busy += cpu_stats->open_busy;
+        stats->nowait_again += cpu_stats->nowait_again;
+        stats->discarded_pages += cpu_stats->discarded;
+        stats->crc_errors += cpu_stats->crc_errors;
+        for (i = 0; i < ASGN1_LAT_BUCKETS; i++) {
+            stats->read_lat[i] += cpu_stats->read_lat[i];
+            stats->write_lat[i] += cpu_stats->write_lat[i];
+            stats->fault_lat[i] += cpu_stats->fault_lat[i];
+        }
+    }
+    stats->num_pages = READ_ONCE(dev->num_pages);
+    stats->data_size = smp_load_acquire(&dev->data_size);
+    stats->compressed_pages = READ_ONCE(dev->num_zpages);
+    stats->compressed_bytes = READ_ONCE(dev->zbytes);
+    rcu_read_lock();
+    store = rcu_dereference(dev->store);
+    stats->dedup_saved = READ_ONCE(store->dedup_nodes) - READ_ONCE(store->dedup_entries);
+    rcu_read_unlock();
+    stats->dirty_pages = READ_ONCE(dev->num_dirty);
+    stats->flushed_bytes = READ_ONCE(dev->flushed_bytes);
+    stats->flush_ns = READ_ONCE(dev->flush_ns);
+    stats->limit_bytes = (u64)READ_ONCE(dev->max_pages) << PAGE_SHIFT;
+    stats->discardable_pages = READ_ONCE(dev->num_discard);
+    stats->scrub_passes = READ_ONCE(dev->scrub_passes);
+    stats->scrubbed_pages = READ_ONCE(dev->scrub_pages);
+    stats->scrub_offset = (u64)READ_ONCE(dev->scrub_pos) << PAGE_SHIFT;
+}
+
+/**
+ * This function returns whether any locked range overlaps [start, end).
+ */
+static bool asgn1_range_busy(asgn1_dev *dev, loff_t start, loff_t end) {
+
+    range_lock *curr;
+
+    list_for_each_entry(curr, &dev->ranges, list) {
+        if (curr->start < end && start < curr->end)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * This function returns the page index of a device. The caller must be in
+ * an RCU read section, hold dev->lock, or hold a range lock, which keeps the
+ * store from being swapped.
+ */
+static inline struct radix_tree_root *asgn1_tree(asgn1_dev *dev) {
+
+    return &rcu_dereference_check(dev->store, lockdep_is_held(&dev->lock))->page_tree;
+}
+
+/**
+ * This function sets the bounds of a range to lock, whole chunks on a contig
+ * device.
+ */
+static inline void asgn1_range_bounds(asgn1_dev *dev, range_lock *range, loff_t start, loff_t end) {
+
+    if (READ_ONCE(dev->contig)) {
+        start = round_down(start, CHUNK_SIZE);
+        if (end <= LLONG_MAX - CHUNK_SIZE)
+            end = round_up(end, CHUNK_SIZE);
+    }
+    range->start = start;
+    range->end = end;
+}
+
+/**
+ * This function locks the byte range [start, end) of the disk, waiting for
+ * any overlapping range to be unlocked first in the given task state. Writers
+ * to disjoint ranges run in parallel. A contig device is locked in whole
+ * chunks, since filling any page of a chunk fills all of it. Returns
+ * -ERESTARTSYS if interrupted by a signal.
+ */
+static int asgn1_lock_range(asgn1_dev *dev, range_lock *range, loff_t start, loff_t end, int state) {
+
+    DEFINE_WAIT(wait);
+    int result = 0;
+
+    asgn1_range_bounds(dev, range, start, end);
+    start = range->start;
+    end = range->end;
+
+    spin_lock(&dev->range_lock);
+    for (;;) {
+        prepare_to_wait(&dev->range_wait, &wait, state);
+        if (!asgn1_range_busy(dev, start, end))
+            break;
+        if (signal_pending_state(state, current)) {
+            result = -ERESTARTSYS;
+            break;
+        }
+        spin_unlock(&dev->range_lock);
+        schedule();
+        spin_lock(&dev->range_lock);
+    }
+    finish_wait(&dev->range_wait, &wait);
+    if (result == 0)
+        list_add(&range->list, &dev->ranges);
+    spin_unlock(&dev->range_lock);
+
+    return result;
+}
+
+/**
+ * This function locks a range like asgn1_lock_range, but returns -EAGAIN
+ * rather than wait for an overlapping one.
+ */
+static int asgn1_trylock_range(asgn1_dev *dev, range_lock *range, loff_t start, loff_t end) {
+
+    bool busy;
+
+    asgn1_range_bounds(dev, range, start, end);
+    spin_lock(&dev->range_lock);
+    busy = asgn1_range_busy(dev, range->start, range->end);
+    if (!busy)
+        list_add(&range->list, &dev->ranges);
+    spin_unlock(&dev->range_lock);
+
+    return busy ? -EAGAIN : 0;
+}
+
+/**
+ * This function unlocks a range locked by asgn1_lock_range.
+ */
+static void asgn1_unlock_range(asgn1_dev *dev, range_lock *range) {
+
+    spin_lock(&dev->range_lock);
+    list_del(&range->list);
+    spin_unlock(&dev->range_lock);
+    wake_up_all(&dev->range_wait);
+}
+
+/**
+ * This function grows data_size to at least size.
+ */
+static void asgn1_grow(asgn1_dev *dev, size_t size) {
+
+    spin_lock(&dev->lock);
+    // publish the new size only once the data behind it is in place
+    if (size > dev->data_size)
+        smp_store_release(&dev->data_size, size);
+    spin_unlock(&dev->lock);
+}
+
+/**
+ * This function returns how many more pages the device may hold before it
+ * reaches its limit, ULONG_MAX if it has none. Writers check it before they
+ * allocate, so a full device fails fast; asgn1_insert_node has the last word.
+ */
+static inline unsigned long asgn1_room(asgn1_dev *dev) {
+
+    unsigned long max_pages = READ_ONCE(dev->max_pages);
+    unsigned long num_pages = READ_ONCE(dev->num_pages);
+
+    if (max_pages == 0)
+        return ULONG_MAX;
+    return max_pages > num_pages ? max_pages - num_pages : 0;
+}
+
+/**
+ * This function adds a node to the page index. Returns -EEXIST if another
+ * writer filled the page first, or -ENOSPC if the device is at its limit.
+ */
+static int asgn1_insert_node(asgn1_dev *dev, unsigned long index, page_node *node) {
+
+    int result;
+
+    result = radix_tree_preload(GFP_KERNEL);
+    if (result < 0)
+        return result;
+    spin_lock(&dev->lock);
+    if (dev->max_pages > 0 && dev->num_pages >= dev->max_pages)
+        result = -ENOSPC;
+    else
+        result = radix_tree_insert(asgn1_tree(dev), index, node);
+    if (result == 0)
+        dev->num_pages++;
+    spin_unlock(&dev->lock);
+    radix_tree_preload_end();
+
+    return result;
+}
+
+/**
+ * This function tags a page as written since it was last written behind to
+ * the backing file. The caller must hold a range lock covering the page, or
+ * the page lock, either of which keeps the flusher from clearing the tag
+ * under us, see asgn1_flush_batch.
+ */
+static void asgn1_mark_dirty(asgn1_dev *dev, unsigned long index) {
+
+    struct radix_tree_root *tree;
+    bool tagged;
+
+    if (dev->wb_file == NULL)
+        return;
+    // most writes land on pages still waiting to be flushed
+    rcu_read_lock();
+    tagged = radix_tree_tag_get(asgn1_tree(dev), index, DIRTY_TAG);
+    rcu_read_unlock();
+    if (tagged)
+        return;
+
+    spin_lock(&dev->lock);
+    tree = asgn1_tree(dev);
+    if (radix_tree_lookup(tree, index) != NULL && !radix_tree_tag_get(tree, index, DIRTY_TAG)) {
+        radix_tree_tag_set(tree, index, DIRTY_TAG);
+        dev->num_dirty++;
+    }
+    spin_unlock(&dev->lock);
+}
+
+/**
+ * This function clears the dirty tag of a page about to be written behind.
+ */
+static void asgn1_clear_dirty(asgn1_dev *dev, unsigned long index) {
+
+    struct radix_tree_root *tree;
+
+    spin_lock(&dev->lock);
+    tree = asgn1_tree(dev);
+    if (radix_tree_tag_get(tree, index, DIRTY_TAG)) {
+        radix_tree_tag_clear(tree, index, DIRTY_TAG);
+        dev->num_dirty--;
+    }
+    spin_unlock(&dev->lock);
+}
+
+/**
+ * This function frees a batch of nodes and their pages, compressed or not.
+ */
+static void free_node_batch(page_node **nodes, struct page **pages, int count) {
+
+    int i, nr = 0;
+
+    for (i = 0; i < count; i++) {
+        if (nodes[i]->page != NULL)
+            pages[nr++] = nodes[i]->page;
+        else
+            kfree(nodes[i]->zdata);
+    }
+    release_pages(pages, nr);
+    kmem_cache_free_bulk(asgn1_node_cache, count, (void **)nodes);
+}
+
+/**
+ * This function allocates an empty store for a device.
+ */
+static asgn1_store *asgn1_alloc_store(asgn1_dev *dev) {
+
+    asgn1_store *store;
+
+    store = kmalloc(sizeof(*store), GFP_KERNEL);
+    if (store == NULL)
+        return NULL;
+    INIT_RADIX_TREE(&store->page_tree, GFP_ATOMIC);
+    store->num_pages = 0;
+    store->minor = MINOR(dev->dev);
+    atomic_set(&store->refs, 1);
+    store->gen = 0;
+    INIT_LIST_HEAD(&store->snapshots);
+    spin_lock_init(&store->dedup_lock);
+    store->dedup_nodes = 0;
+    store->dedup_entries = 0;
+    store->dedup_table = NULL;
+    if (dedup) {
+        store->dedup_table = kvmalloc_array(1 << DEDUP_BITS, sizeof(struct hlist_head),
+                                            GFP_KERNEL | __GFP_ZERO);
+        if (store->dedup_table == NULL) {
+            kfree(store);
+            return NULL;
+        }
+    }
+
+    return store;
+}
+
+/**
+ * This function frees a store once its pages are gone, along with the
+ * entries of the pages they shared.
+ */
+static void asgn1_release_store(asgn1_store *store) {
+
+    struct hlist_node *tmp;
+    dedup_page *dup;
+    int i;
+
+    if (store->dedup_table != NULL) {
+        for (i = 0; i < 1 << DEDUP_BITS; i++) {
+            hlist_for_each_entry_safe(dup, tmp, &store->dedup_table[i], hash)
+                kfree(dup);
+        }
+        kvfree(store->dedup_table);
+    }
+    kfree(store);
+}
+
+/**
+ * This function frees a detached store and all its pages, in batches. It
+ * runs from asgn1_free_wq after an RCU grace period, so the store is ours
+ * alone; readers still copying out of a page hold their own reference to it.
+ */
+static void asgn1_free_store(struct work_struct *work) {
+
+    asgn1_store *store = container_of(to_rcu_work(work), asgn1_store, free_work);
+    struct radix_tree_iter iter;
+    void **slot;
+    page_node *nodes[FREE_BATCH];
+    struct page *pages[FREE_BATCH];
+    unsigned long index = 0;
+    unsigned long first = 0;
+    int count;
+
+    pr_debug("asgn1: freeing %d pages of asgn1%d\n", store->num_pages, store->minor);
+
+    do {
+        count = 0;
+        radix_tree_for_each_slot(slot, &store->page_tree, &iter, index) {
+            nodes[count] = rcu_dereference_raw(*slot);
+            if (count == 0)
+                first = iter.index;
+            radix_tree_iter_delete(&store->page_tree, &iter, slot);
+            index = iter.index + 1;
+            if (++count == FREE_BATCH)
+                break;
+        }
+        store->num_pages -= count;
+
+        if (count > 0) {
+            trace_asgn1_pages_free(store->minor, first, count, store->num_pages);
+            free_node_batch(nodes, pages, count);
+        }
+        cond_resched();
+    } while (count == FREE_BATCH);
+
+    asgn1_release_store(store);
+}
+
+/**
+ * This function drops a reference to a store, handing it to asgn1_free_wq to
+ * be freed once it is detached and no snapshot of it is left open.
+ */
+static void asgn1_queue_free_store(asgn1_store *store) {
+
+    if (!atomic_dec_and_test(&store->refs))
+        return;
+    INIT_RCU_WORK(&store->free_work, asgn1_free_store);
+    queue_rcu_work(asgn1_free_wq, &store->free_work);
+}
+
+/**
+ * This function frees all memory pages held by the device. The pages are
+ * detached in O(1) by swapping in an empty store and freed in the
+ * background, so the caller does not wait for them. The caller must have the
+ * whole disk range locked or otherwise have the device to itself.
+ */
+int free_memory_pages(asgn1_dev *dev) {
+
+    asgn1_store *store, *old;
+    int num_pages;
+
+    pr_debug("asgn1: free_memory_pages called\n");
+
+    // shrink the disk first so new readers see nothing left to read
+    spin_lock(&dev->lock);
+    smp_store_release(&dev->data_size, 0);
+    num_pages = dev->num_pages;
+    spin_unlock(&dev->lock);
+
+    // nothing to detach, keep the store
+    if (num_pages == 0)
+        return 0;
+
+    store = asgn1_alloc_store(dev);
+    if (store == NULL)
+        return -ENOMEM;
+
+    spin_lock(&dev->lock);
+    old = rcu_dereference_protected(dev->store, lockdep_is_held(&dev->lock));
+    old->num_pages = dev->num_pages;
+    dev->num_pages = 0;
+    dev->num_zpages = 0;
+    dev->zbytes = 0;
+    dev->num_dirty = 0;
+    dev->num_discard = 0;
+    dev->wb_truncated = true;
+    rcu_assign_pointer(dev->store, store);
+    spin_unlock(&dev->lock);
+
+    asgn1_count(dev, pages_freed, old->num_pages);
+    asgn1_queue_free_store(old);
+    
+    pr_debug("asgn1: free_memory_pages finished\n");
+
+    return 0;
+}
+
+/**
+ * This function notes that a page was just used, so it is not compressed.
+ * The node is only written once per jiffy, to spare readers the cache line.
+ */
+static inline void asgn1_touch(page_node *node) {
+
+    if (compress_secs > 0 && READ_ONCE(node->atime) != jiffies)
+        WRITE_ONCE(node->atime, jiffies);
+}
+
+/**
+ * This function returns the CRC32C of a page. crc32c picks the fastest
+ * implementation the CPU has, such as the SSE4.2 instruction on x86.
+ */
+static inline u32 asgn1_page_crc(struct page *page) {
+
+    void *addr;
+    u32 crc;
+
+    addr = kmap_atomic(page);
+    crc = crc32c(~0, addr, PAGE_SIZE);
+    kunmap_atomic(addr);
+
+    return crc;
+}
+
+/**
+ * This function records the CRC32C of a page just written, if checksums are
+ * kept. The caller must hold a range lock covering the page. A page that may
+ * still be written through a mapping keeps its CRC untrusted, until the
+ * scrubber write-protects it again, see asgn1_reset_crc.
+ */
+static void asgn1_set_crc(page_node *node) {
+
+    if (checksum && READ_ONCE(node->crc_ok))
+        node->crc = asgn1_page_crc(node->page);
+}
+
+/**
+ * This function returns the CRC32C from a zero seed of len bytes of a page
+ * at offset, see asgn1_update_crc.
+ */
+static inline u32 asgn1_span_crc(struct page *page, size_t offset, size_t len) {
+
+    void *addr;
+    u32 crc;
+
+    addr = kmap_atomic(page);
+    crc = crc32c(0, addr + offset, len);
+    kunmap_atomic(addr);
+
+    return crc;
+}
+
+/**
+ * This function updates the CRC32C of a page whose len bytes at offset were
+ * just overwritten, given old, the asgn1_span_crc of those bytes before.
+ * CRCs are linear, so the change to the page CRC is the CRC of the change
+ * to the bytes, shifted past the rest of the page. That costs two passes
+ * over the bytes written instead of one over the whole page, and leaves
+ * any corruption elsewhere in the page to be found. The caller must hold
+ * a range lock covering the page.
+ */
+static void asgn1_update_crc(page_node *node, size_t offset, size_t len, u32 old) {
+
+    u32 delta;
+
+    if (checksum && READ_ONCE(node->crc_ok)) {
+        delta = old ^ asgn1_span_crc(node->page, offset, len);
+        node->crc ^= __crc32c_le_shift(delta, PAGE_SIZE - offset - len);
+    }
+}
+
+/**
+ * This function records the CRC32C of a page no mapping can write, and
+ * trusts it again. The caller must hold the page lock and a range lock
+ * covering the page, and have unmapped it.
+ */
+static void asgn1_reset_crc(page_node *node) {
+
+    node->crc = asgn1_page_crc(node->page);
+    WRITE_ONCE(node->crc_ok, true);
+}
+
+/**
+ * This function checks a page against its CRC32C, counting the error and
+ * returning -EIO if it doesn't match. The caller must hold a range lock
+ * covering the page, so only a write through a mapping can change it, and
+ * then the CRC is no longer trusted anyway.
+ */
+static int asgn1_check_crc(asgn1_dev *dev, unsigned long index, page_node *node, struct page *page) {
+
+    u32 crc;
+
+    if (!checksum || !READ_ONCE(node->crc_ok))
+        return 0;
+    crc = asgn1_page_crc(page);
+    // see if a write through a mapping started meanwhile
+    smp_rmb();
+    if (crc == node->crc || !READ_ONCE(node->crc_ok))
+        return 0;
+
+    asgn1_count(dev, crc_errors, 1);
+    printk_ratelimited(KERN_ERR "asgn1: %s%d: page %lu fails its checksum\n",
+                       MYDEV_NAME, MINOR(dev->dev), index);
+    return -EIO;
+}
+
+/**
+ * This function stops trusting the CRC32C of a page about to be made
+ * writable through a mapping, until the scrubber or write-behind seals it
+ * again. The caller must hold the page lock.
+ */
+static void asgn1_crc_stale(asgn1_dev *dev, unsigned long index) {
+
+    page_node *curr;
+
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    if (curr != NULL)
+        WRITE_ONCE(curr->crc_ok, false);
+    rcu_read_unlock();
+}
+
+/**
+ * This function decompresses the contents of a compressed node into page,
+ * leaving the node as it is. The caller must hold a range lock covering it.
+ */
+static int asgn1_unzip(page_node *node, struct page *page) {
+
+    struct crypto_comp *tfm;
+    unsigned int len = PAGE_SIZE;
+    int result;
+
+    tfm = *get_cpu_ptr(asgn1_tfms);
+    result = crypto_comp_decompress(tfm, node->zdata, node->zlen, page_address(page), &len);
+    put_cpu_ptr(asgn1_tfms);
+    if (result < 0 || len != PAGE_SIZE) {
+        printk(KERN_WARNING "asgn1: Couldn't decompress page!\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * This function decompresses a page back into a fresh page, checking it
+ * against its CRC32C. The caller must hold a range lock covering the page.
+ */
+static int asgn1_decompress_node(asgn1_dev *dev, unsigned long index, page_node *node) {
+
+    struct page *page;
+    void *zdata = node->zdata;
+    int result;
+
+    page = alloc_page(GFP_KERNEL);
+    if (page == NULL)
+        return -ENOMEM;
+
+    result = asgn1_unzip(node, page);
+    if (result == 0)
+        result = asgn1_check_crc(dev, index, node, page);
+    if (result < 0) {
+        __free_page(page);
+        return result;
+    }
+
+    spin_lock(&dev->lock);
+    dev->num_zpages--;
+    dev->zbytes -= node->zlen;
+    node->zdata = NULL;
+    node->atime = jiffies;
+    // lockless readers may pick the page up as soon as it is set
+    smp_store_release(&node->page, page);
+    spin_unlock(&dev->lock);
+    kfree(zdata);
+
+    return 0;
+}
+
+/**
+ * This function compresses a page if that saves at least a quarter of it,
+ * using buf, ZBUF_SIZE bytes, as scratch space. The caller must hold a range
+ * lock covering the page. Pages anyone else holds a reference to, through a
+ * read, a mapping or a pipe, are left alone.
+ */
+static void asgn1_compress_node(asgn1_dev *dev, page_node *node, u8 *buf) {
+
+    struct crypto_comp *tfm;
+    struct page *page = node->page;
+    unsigned int zlen = ZBUF_SIZE;
+    void *zdata = NULL;
+    int result;
+
+    // readers spin on a frozen page, so nothing can change it or start
+    // using it while it is compressed
+    if (!page_ref_freeze(page, 1))
+        return;
+    // no mapping holds it now, so a CRC left stale by one can be trusted again
+    if (checksum && !node->crc_ok)
+        asgn1_reset_crc(node);
+
+    tfm = *get_cpu_ptr(asgn1_tfms);
+    result = crypto_comp_compress(tfm, page_address(page), PAGE_SIZE, buf, &zlen);
+    put_cpu_ptr(asgn1_tfms);
+    if (result == 0 && zlen <= PAGE_SIZE * 3 / 4)
+        zdata = kmalloc(zlen, GFP_NOWAIT | __GFP_NOWARN);
+    if (zdata == NULL) {
+        page_ref_unfreeze(page, 1);
+        // don't try again until it has been idle for another interval
+        node->atime = jiffies;
+        return;
+    }
+    memcpy(zdata, buf, zlen);
+
+    spin_lock(&dev->lock);
+    node->zdata = zdata;
+    node->zlen = zlen;
+    WRITE_ONCE(node->page, NULL);
+    dev->num_zpages++;
+    dev->zbytes += zlen;
+    spin_unlock(&dev->lock);
+
+    // a reader that saw the old page may still take a reference before
+    // this one is dropped, it will notice node->page changed and let go
+    page_ref_unfreeze(page, 1);
+    put_page(page);
+}
+
+/**
+ * This function returns the store of a device to a caller holding a range
+ * lock, which keeps it from being swapped.
+ */
+static inline asgn1_store *asgn1_locked_store(asgn1_dev *dev) {
+
+    return rcu_dereference_protected(dev->store, true);
+}
+
+/**
+ * This function shares a page just filled by a write with an identical page
+ * of the store, or offers it to be shared if there is none yet. The caller
+ * must hold a range lock covering the page. Pages anyone else holds a
+ * reference to are left alone, in particular mapped pages, since a write
+ * through the mapping would change every page sharing it.
+ */
+static void asgn1_dedup_node(asgn1_dev *dev, page_node *node) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    struct page *page = node->page;
+    dedup_page *dup, *new_dup;
+    u32 key;
+
+    new_dup = kmalloc(sizeof(*new_dup), GFP_KERNEL | __GFP_NOWARN);
+    if (new_dup == NULL)
+        return;
+    key = jhash2(page_address(page), PAGE_SIZE / sizeof(u32), 0);
+
+    spin_lock(&store->dedup_lock);
+    hlist_for_each_entry(dup, &store->dedup_table[hash_32(key, DEDUP_BITS)], hash) {
+        if (dup->key == key && memcmp(page_address(dup->page), page_address(page), PAGE_SIZE) == 0)
+            break;
+    }
+    // readers spin on a frozen page, so none can map it before node->dup is set
+    if (!page_ref_freeze(page, 1)) {
+        spin_unlock(&store->dedup_lock);
+        kfree(new_dup);
+        return;
+    }
+    if (dup != NULL) {
+        get_page(dup->page);
+        dup->refs++;
+        node->dup = dup;
+        smp_store_release(&node->page, dup->page);
+    }
+    else {
+        new_dup->page = page;
+        new_dup->key = key;
+        new_dup->refs = 1;
+        hlist_add_head(&new_dup->hash, &store->dedup_table[hash_32(key, DEDUP_BITS)]);
+        node->dup = new_dup;
+        store->dedup_entries++;
+        new_dup = NULL;
+    }
+    store->dedup_nodes++;
+    spin_unlock(&store->dedup_lock);
+
+    page_ref_unfreeze(page, 1);
+    // our own page was replaced by the shared one
+    if (dup != NULL)
+        put_page(page);
+    kfree(new_dup);
+}
+
+/**
+ * This function gives a node sharing a page a private copy of it, so it can
+ * be written or mapped. The caller must hold a range lock covering the page.
+ */
+static int asgn1_unshare_node(asgn1_dev *dev, page_node *node) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    dedup_page *dup = node->dup;
+    struct page *shared = dup->page;
+    struct page *page = NULL;
+    bool last;
+
+    spin_lock(&store->dedup_lock);
+    last = dup->refs == 1;
+    spin_unlock(&store->dedup_lock);
+
+    // the last user of a page can keep it, otherwise copy it first
+    if (!last) {
+        page = alloc_page(GFP_KERNEL);
+        if (page == NULL)
+            return -ENOMEM;
+        copy_highpage(page, shared);
+    }
+
+    spin_lock(&store->dedup_lock);
+    node->dup = NULL;
+    store->dedup_nodes--;
+    if (--dup->refs == 0) {
+        hlist_del(&dup->hash);
+        store->dedup_entries--;
+    }
+    else {
+        dup = NULL;
+    }
+    if (page != NULL)
+        smp_store_release(&node->page, page);
+    spin_unlock(&store->dedup_lock);
+
+    // others unsharing meanwhile may have left us the last user after all,
+    // then this frees the shared page
+    if (page != NULL)
+        put_page(shared);
+    kfree(dup);
+
+    return 0;
+}
+
+/**
+ * This function gives each snapshot that still sees a page a copy of it,
+ * before the page is first written or mapped since the snapshot was taken.
+ * One copy is shared by all of them. The caller must hold a range lock
+ * covering the page, which must not be compressed.
+ */
+static int asgn1_preserve_node(asgn1_dev *dev, unsigned long index, page_node *node) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    asgn1_snapshot *snap;
+    struct page *copy = NULL;
+    int result = 0;
+
+    // snapshots are newest first, those taken before the page was last
+    // written never saw this version of it
+    list_for_each_entry(snap, &store->snapshots, list) {
+        if (snap->gen < node->gen)
+            break;
+        if (copy == NULL) {
+            copy = alloc_page(GFP_KERNEL);
+            if (copy == NULL)
+                return -ENOMEM;
+            copy_highpage(copy, node->page);
+        }
+        result = radix_tree_preload(GFP_KERNEL);
+        if (result < 0)
+            break;
+        spin_lock(&snap->lock);
+        result = radix_tree_insert(&snap->pages, index, copy);
+        spin_unlock(&snap->lock);
+        radix_tree_preload_end();
+        // kept by an earlier attempt that ran out of memory part way
+        if (result == -EEXIST) {
+            result = 0;
+            continue;
+        }
+        if (result < 0)
+            break;
+        get_page(copy);
+    }
+    if (copy != NULL)
+        put_page(copy);
+    // only now may lockless faults map the page, see asgn1_get_page_rcu
+    if (result == 0)
+        WRITE_ONCE(node->gen, store->gen);
+
+    return result;
+}
+
+/**
+ * This function returns the node of the given page, allocating a zeroed page
+ * for it if the page is currently a hole, or decompressing, preserving or
+ * unsharing it, so the page can be written. Returns -ENOMEM if out of
+ * memory, -ENOSPC if the device is at its limit, or -EIO if the page was
+ * compressed and fails its checksum. The caller must hold a
+ * range lock covering the page, so it cannot be freed.
+ */
+static page_node *asgn1_get_node(asgn1_dev *dev, unsigned long index) {
+
+    page_node *curr;
+    int result;
+
+    do {
+        rcu_read_lock();
+        curr = radix_tree_lookup(asgn1_tree(dev), index);
+        rcu_read_unlock();
+        if (curr != NULL) {
+            if (curr->page == NULL) {
+                result = asgn1_decompress_node(dev, index, curr);
+                if (result < 0)
+                    return ERR_PTR(result);
+            }
+            if (curr->gen != asgn1_locked_store(dev)->gen &&
+                asgn1_preserve_node(dev, index, curr) < 0)
+                return ERR_PTR(-ENOMEM);
+            if (curr->dup != NULL && asgn1_unshare_node(dev, curr) < 0)
+                return ERR_PTR(-ENOMEM);
+            asgn1_touch(curr);
+            return curr;
+        }
+
+        // fail fast rather than allocate a page we can't keep
+        if (asgn1_room(dev) == 0)
+            return ERR_PTR(-ENOSPC);
+        curr = kmem_cache_alloc(asgn1_node_cache, GFP_KERNEL);
+        if (curr == NULL) {
+            printk(KERN_WARNING "asgn1: Couldn't allocate page node!\n");
+            return ERR_PTR(-ENOMEM);
+        }
+        curr->zdata = NULL;
+        curr->dup = NULL;
+        curr->atime = jiffies;
+        curr->gen = asgn1_locked_store(dev)->gen;
+        curr->crc = asgn1_zero_crc;
+        curr->crc_ok = true;
+        curr->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (curr->page == NULL) {
+            printk(KERN_WARNING "asgn1: Page allocation failed!\n");
+            kmem_cache_free(asgn1_node_cache, curr);
+            return ERR_PTR(-ENOMEM);
+        }
+        result = asgn1_insert_node(dev, index, curr);
+        if (result < 0) {
+            __free_page(curr->page);
+            kmem_cache_free(asgn1_node_cache, curr);
+        }
+        // a writer to another part of the same page may have beaten us to it
+    } while (result == -EEXIST);
+
+    if (result < 0) {
+        if (result != -ENOSPC)
+            printk(KERN_WARNING "asgn1: Couldn't index page %lu!\n", index);
+        return ERR_PTR(result);
+    }
+    trace_asgn1_pages_alloc(MINOR(dev->dev), index, 1, dev->num_pages);
+    asgn1_count(dev, pages_alloc, 1);
+
+    return curr;
+}
+
+/**
+ * This function decompresses a page found compressed by asgn1_get_page_rcu,
+ * returning it with a reference held, NULL if it turned into a hole in the
+ * meantime, or an error.
+ */
+static struct page *asgn1_get_page_slow(asgn1_dev *dev, unsigned long index) {
+
+    page_node *curr;
+    struct page *page = NULL;
+    range_lock range;
+    int result = 0;
+
+    asgn1_lock_range(dev, &range, (loff_t)index << PAGE_SHIFT,
+                     (loff_t)(index + 1) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    rcu_read_unlock();
+    if (curr != NULL) {
+        if (curr->page == NULL)
+            result = asgn1_decompress_node(dev, index, curr);
+        if (result == 0) {
+            page = curr->page;
+            get_page(page);
+            asgn1_touch(curr);
+        }
+        else {
+            page = ERR_PTR(result);
+        }
+    }
+    asgn1_unlock_range(dev, &range);
+
+    return page;
+}
+
+/**
+ * This function looks up a page without taking any lock, returning it with
+ * a reference held, NULL if it is a hole, or an error if a compressed page
+ * could not be restored. The page may be freed and its node reused while we
+ * look, so the lookup is rechecked once the reference is taken, the same way
+ * the page cache does it. Callers that want a page of their own to map pass
+ * GET_PRIVATE, and get NULL for a page shared with other pages or snapshots
+ * as for a hole. Callers that can't wait pass GET_NOWAIT, and get -EAGAIN
+ * for a compressed page.
+ */
+static struct page *asgn1_get_page_rcu(asgn1_dev *dev, unsigned long index, unsigned int flags) {
+
+    page_node *curr;
+    struct page *page = NULL;
+
+    rcu_read_lock();
+repeat:
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    if (curr != NULL) {
+        page = READ_ONCE(curr->page);
+        if (page == NULL) {
+            rcu_read_unlock();
+            if (flags & GET_NOWAIT)
+                return ERR_PTR(-EAGAIN);
+            return asgn1_get_page_slow(dev, index);
+        }
+        if (!get_page_unless_zero(page))
+            goto repeat;
+        // the store may also have been swapped out from under us
+        if (radix_tree_lookup(asgn1_tree(dev), index) != curr ||
+            READ_ONCE(curr->page) != page) {
+            put_page(page);
+            goto repeat;
+        }
+        // a page can't become shared while we hold a reference to it, nor
+        // can a snapshot be taken of it without unmapping it again
+        if ((flags & GET_PRIVATE) && (READ_ONCE(curr->dup) != NULL ||
+                        READ_ONCE(curr->gen) != READ_ONCE(rcu_dereference(dev->store)->gen))) {
+            put_page(page);
+            page = NULL;
+        }
+        else {
+            asgn1_touch(curr);
+        }
+    }
+    else {
+        page = NULL;
+    }
+    rcu_read_unlock();
+
+    return page;
+}
+
+/**
+ * This function checks a page found by asgn1_get_page_rcu against its
+ * CRC32C before it is read. The first check takes no lock, so a mismatch
+ * may just be a write in progress; it only counts if it holds once the
+ * page is locked, unless nowait is set, when -EAGAIN is returned instead.
+ */
+static int asgn1_verify_page(asgn1_dev *dev, unsigned long index, struct page *page, bool nowait) {
+
+    page_node *curr;
+    range_lock range;
+    bool skip;
+    u32 crc = 0;
+    int result = 0;
+
+    if (!checksum)
+        return 0;
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    skip = curr == NULL || READ_ONCE(curr->page) != page || !READ_ONCE(curr->crc_ok);
+    if (!skip)
+        crc = READ_ONCE(curr->crc);
+    rcu_read_unlock();
+    if (skip || asgn1_page_crc(page) == crc)
+        return 0;
+    if (nowait)
+        return -EAGAIN;
+
+    asgn1_lock_range(dev, &range, (loff_t)index << PAGE_SHIFT,
+                     (loff_t)(index + 1) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    rcu_read_unlock();
+    if (curr != NULL && curr->page == page)
+        result = asgn1_check_crc(dev, index, curr, page);
+    asgn1_unlock_range(dev, &range);
+
+    return result;
+}
+
+/**
+ * This function returns the first page number at or after index which holds
+ * data, or -1 if there is none.
+ */
+static long asgn1_next_data(asgn1_dev *dev, unsigned long index) {
+
+    struct radix_tree_iter iter;
+    void **slot;
+    long data = -1;
+
+    rcu_read_lock();
+    radix_tree_for_each_slot(slot, asgn1_tree(dev), &iter, index) {
+        data = iter.index;
+        break;
+    }
+    rcu_read_unlock();
+
+    return data;
+}
+
+/**
+ * This function returns the first page number at or after index which is
+ * a hole.
+ */
+static unsigned long asgn1_next_hole(asgn1_dev *dev, unsigned long index) {
+
+    struct radix_tree_iter iter;
+    void **slot;
+
+    rcu_read_lock();
+    radix_tree_for_each_contig(slot, asgn1_tree(dev), &iter, index)
+        index = iter.index + 1;
+    rcu_read_unlock();
+
+    return index;
+}
+
+/**
+ * This function fills count consecutive holes starting at index, using one
+ * higher-order page allocation and one bulk node allocation per block rather
+ * than two allocator calls per page. Pages come from NUMA node nid if
+ * possible, any node for NUMA_NO_NODE. The caller has checked there is
+ * room for count more pages. Returns the number of pages covered, or 0 if
+ * nothing could be filled.
+ */
+static unsigned long asgn1_fill_block(asgn1_dev *dev, unsigned long index, unsigned long count, int nid) {
+
+    page_node *nodes[1 << FILL_ORDER];
+    struct page *page = NULL;
+    unsigned int order = min_t(unsigned int, ilog2(count), FILL_ORDER);
+    unsigned int i, nr, filled;
+
+    // fall back to smaller blocks when memory is fragmented
+    for (; order > 0; order--) {
+        page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN, order);
+        if (page != NULL)
+            break;
+    }
+    if (page == NULL)
+        page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0);
+    if (page == NULL)
+        return 0;
+    nr = 1 << order;
+    split_page(page, order);
+
+    if (kmem_cache_alloc_bulk(asgn1_node_cache, GFP_KERNEL, nr, (void **)nodes) == 0) {
+        for (i = 0; i < nr; i++)
+            __free_page(page + i);
+        return 0;
+    }
+
+    // give back whatever could not be indexed, including pages another
+    // writer filled in the meantime
+    for (i = 0, filled = 0; i < nr; i++) {
+        nodes[i]->page = page + i;
+        nodes[i]->zdata = NULL;
+        nodes[i]->dup = NULL;
+        nodes[i]->atime = jiffies;
+        nodes[i]->gen = asgn1_locked_store(dev)->gen;
+        nodes[i]->crc = asgn1_zero_crc;
+        nodes[i]->crc_ok = true;
+        if (asgn1_insert_node(dev, index + i, nodes[i]) == 0) {
+            filled++;
+            continue;
+        }
+        __free_page(page + i);
+        kmem_cache_free(asgn1_node_cache, nodes[i]);
+    }
+    trace_asgn1_pages_alloc(MINOR(dev->dev), index, filled, dev->num_pages);
+    asgn1_count(dev, pages_alloc, filled);
+
+    return filled > 0 ? nr : 0;
+}
+
+/**
+ * This function fills the empty chunk of a contig device starting at index
+ * with one physically contiguous allocation, split into order-0 pages that
+ * are each indexed by their own node, so the rest of the driver treats
+ * them like any other run of pages. Returns the number of pages covered,
+ * or 0 if no chunk could be had or the device has no room for it.
+ */
+static unsigned long asgn1_fill_chunk(asgn1_dev *dev, unsigned long index, int nid) {
+
+    page_node *nodes[FREE_BATCH];
+    struct page *page;
+    unsigned long i, filled = 0;
+    unsigned int j, nr;
+
+    if (asgn1_room(dev) < CHUNK_NR)
+        return 0;
+
+    page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN, CHUNK_ORDER);
+    if (page == NULL)
+        return 0;
+    split_page(page, CHUNK_ORDER);
+
+    for (i = 0; i < CHUNK_NR; i += nr) {
+        nr = kmem_cache_alloc_bulk(asgn1_node_cache, GFP_KERNEL, FREE_BATCH, (void **)nodes);
+        for (j = 0; j < nr; j++) {
+            nodes[j]->page = page + i + j;
+            nodes[j]->zdata = NULL;
+            nodes[j]->dup = NULL;
+            nodes[j]->atime = jiffies;
+            nodes[j]->gen = asgn1_locked_store(dev)->gen;
+            nodes[j]->crc = asgn1_zero_crc;
+            nodes[j]->crc_ok = true;
+            if (asgn1_insert_node(dev, index + i + j, nodes[j]) == 0) {
+                filled++;
+                continue;
+            }
+            put_page(page + i + j);
+            kmem_cache_free(asgn1_node_cache, nodes[j]);
+        }
+        if (nr == 0)
+            break;
+    }
+    // free the pages no node could be had for
+    for (; i < CHUNK_NR; i++)
+        put_page(page + i);
+    trace_asgn1_pages_alloc(MINOR(dev->dev), index, filled, dev->num_pages);
+    asgn1_count(dev, pages_alloc, filled);
+
+    return filled > 0 ? CHUNK_NR : 0;
+}
+
+/**
+ * This function fills every hole between the pages first and last inclusive,
+ * from NUMA node nid if possible. Returns -ENOMEM if it ran out of memory,
+ * or -ENOSPC if the device reached its limit. A contig device fills whole
+ * empty chunks at a time, which the caller must hold the range lock of, and
+ * falls back to small pages when it can't.
+ */
+static int asgn1_fill_holes(asgn1_dev *dev, unsigned long first, unsigned long last, int nid) {
+
+    unsigned long hole, next, filled, chunk, room;
+    long data;
+
+    while (first <= last) {
+        hole = asgn1_next_hole(dev, first);
+        if (hole > last)
+            break;
+        data = asgn1_next_data(dev, hole);
+        next = (data < 0 || data > last) ? last + 1 : data;
+        if (dev->contig) {
+            chunk = round_down(hole, CHUNK_NR);
+            data = asgn1_next_data(dev, chunk);
+            if ((data < 0 || data >= chunk + CHUNK_NR) && asgn1_fill_chunk(dev, chunk, nid) > 0) {
+                first = chunk + CHUNK_NR;
+                continue;
+            }
+        }
+        while (hole < next) {
+            room = asgn1_room(dev);
+            if (room == 0)
+                return -ENOSPC;
+            filled = asgn1_fill_block(dev, hole, min(next - hole, room), nid);
+            if (filled == 0)
+                return asgn1_room(dev) == 0 ? -ENOSPC : -ENOMEM;
+            hole += filled;
+        }
+        first = next;
+    }
+    return 0;
+}
+
+/**
+ * This function compresses the idle pages among the FREE_BATCH pages from
+ * first, holding their range so no writer or fault can touch them meanwhile.
+ */
+static void asgn1_compress_batch(asgn1_dev *dev, unsigned long first, u8 *buf) {
+
+    unsigned long idle = compress_secs * HZ;
+    unsigned long index;
+    page_node *curr;
+    range_lock range;
+
+    asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                     (loff_t)(first + FREE_BATCH) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    for (index = first; index < first + FREE_BATCH; index++) {
+        rcu_read_lock();
+        curr = radix_tree_lookup(asgn1_tree(dev), index);
+        rcu_read_unlock();
+        if (curr != NULL && curr->page != NULL && curr->dup == NULL &&
+            time_after(jiffies, READ_ONCE(curr->atime) + idle))
+            asgn1_compress_node(dev, curr, buf);
+    }
+    asgn1_unlock_range(dev, &range);
+}
+
+/**
+ * This function makes a pass over the device every compress_secs,
+ * compressing the pages that have not been used for that long.
+ */
+static void asgn1_compress_work(struct work_struct *work) {
+
+    asgn1_dev *dev = container_of(to_delayed_work(work), asgn1_dev, compress_work);
+    unsigned long index = 0;
+    long data;
+    u8 *buf;
+
+    buf = kmalloc(ZBUF_SIZE, GFP_KERNEL);
+    if (buf != NULL) {
+        while ((data = asgn1_next_data(dev, index)) >= 0) {
+            asgn1_compress_batch(dev, data, buf);
+            index = data + FREE_BATCH;
+            cond_resched();
+        }
+        kfree(buf);
+    }
+    pr_debug("asgn1: asgn1%d has %d of %d pages compressed into %zu bytes\n",
+             MINOR(dev->dev), dev->num_zpages, dev->num_pages, dev->zbytes);
+
+    queue_delayed_work(system_long_wq, &dev->compress_work, compress_secs * HZ);
+}
+
+/**
+ * This function scrubs the FREE_BATCH pages from first, holding their range
+ * so no writer can change them meanwhile. Pages whose CRC32C is trusted are
+ * checked against it; pages written through a mapping since they were last
+ * sealed are write-protected and sealed again instead. Compressed pages
+ * are left alone, they are checked when decompressed.
+ */
+static void asgn1_scrub_batch(asgn1_dev *dev, unsigned long first) {
+
+    struct address_space *mapping = &dev->mapping;
+    unsigned long index, done = 0;
+    page_node *curr;
+    range_lock range;
+
+    asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                     (loff_t)(first + FREE_BATCH) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    for (index = first; index < first + FREE_BATCH; index++) {
+        rcu_read_lock();
+        curr = radix_tree_lookup(asgn1_tree(dev), index);
+        rcu_read_unlock();
+        if (curr == NULL || curr->page == NULL)
+            continue;
+        if (READ_ONCE(curr->crc_ok)) {
+            asgn1_check_crc(dev, index, curr, curr->page);
+        }
+        else {
+            lock_page(curr->page);
+            unmap_mapping_range(mapping, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, 0);
+            asgn1_reset_crc(curr);
+            unlock_page(curr->page);
+        }
+        done++;
+    }
+    WRITE_ONCE(dev->scrub_pos, first + FREE_BATCH);
+    asgn1_unlock_range(dev, &range);
+    WRITE_ONCE(dev->scrub_pages, dev->scrub_pages + done);
+}
+
+/**
+ * This function makes a pass over the device every scrub_secs, checking
+ * each page against its CRC32C so that corruption is found before it is
+ * read, see asgn1_scrub_batch.
+ */
+static void asgn1_scrub_work(struct work_struct *work) {
+
+    asgn1_dev *dev = container_of(to_delayed_work(work), asgn1_dev, scrub_work);
+    unsigned long index = 0;
+    long data;
+
+    while ((data = asgn1_next_data(dev, index)) >= 0) {
+        asgn1_scrub_batch(dev, data);
+        index = data + FREE_BATCH;
+        cond_resched();
+    }
+    WRITE_ONCE(dev->scrub_pos, 0);
+    WRITE_ONCE(dev->scrub_passes, dev->scrub_passes + 1);
+    pr_debug("asgn1: asgn1%d scrubbed, %llu passes\n", MINOR(dev->dev), dev->scrub_passes);
+
+    queue_delayed_work(system_long_wq, &dev->scrub_work, scrub_secs * HZ);
+}
+
+/**
+ * This function opens the backing file of the disk with the given index.
+ */
+static struct file *asgn1_open_backing(int index, int flags) {
+
+    struct file *file;
+    char *path;
+
+    path = kasprintf(GFP_KERNEL, "%s.%d", backing, index);
+    if (path == NULL)
+        return ERR_PTR(-ENOMEM);
+    file = filp_open(path, flags | O_LARGEFILE, 0600);
+    kfree(path);
+
+    return file;
+}
+
+/**
+ * This function writes nr consecutive pages of the disk from first, given in
+ * bvec, to the backing file with one call, straight from the pages.
+ */
+static int asgn1_save_run(struct file *file, struct bio_vec *bvec, unsigned int nr, unsigned long first) {
+
+    struct iov_iter iter;
+    loff_t pos = PAGE_SIZE + ((loff_t)first << PAGE_SHIFT);
+    ssize_t result;
+
+    iov_iter_bvec(&iter, ITER_BVEC | WRITE, bvec, nr, nr * PAGE_SIZE);
+    result = vfs_iter_write(file, &iter, &pos, 0);
+    if (result < 0)
+        return result;
+    return result == nr * PAGE_SIZE ? 0 : -EIO;
+}
+
+/**
+ * This function writes the header of a backing file for a disk of size bytes.
+ */
+static int asgn1_write_hdr(struct file *file, size_t size) {
+
+    asgn1_save_hdr hdr;
+    loff_t pos = 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic));
+    hdr.version = cpu_to_le32(SAVE_VERSION);
+    hdr.page_size = cpu_to_le32(PAGE_SIZE);
+    hdr.data_size = cpu_to_le64(size);
+    if (kernel_write(file, &hdr, sizeof(hdr), &pos) != sizeof(hdr))
+        return -EIO;
+    return 0;
+}
+
+/**
+ * This function saves a disk to its backing file on unload, as runs of up to
+ * SAVE_BATCH pages written in order, skipping holes. Compressed pages are
+ * decompressed into bounce pages on the way.
+ */
+static int asgn1_save_device(asgn1_dev *dev, int index) {
+
+    struct radix_tree_iter iter;
+    struct bio_vec *bvec;
+    struct page **bounce;
+    struct file *file;
+    page_node *curr;
+    range_lock range;
+    unsigned long first = 0, last;
+    unsigned int nr = 0, i;
+    void **slot;
+    int result = 0;
+
+    file = asgn1_open_backing(index, O_WRONLY | O_CREAT | O_TRUNC);
+    if (IS_ERR(file))
+        return PTR_ERR(file);
+    bvec = kmalloc_array(SAVE_BATCH, sizeof(*bvec), GFP_KERNEL);
+    bounce = kcalloc(SAVE_BATCH, sizeof(*bounce), GFP_KERNEL);
+    if (bvec == NULL || bounce == NULL) {
+        result = -ENOMEM;
+        goto out;
+    }
+
+    // the compressor may still be running, nothing else can be
+    asgn1_lock_range(dev, &range, 0, LLONG_MAX, TASK_UNINTERRUPTIBLE);
+    last = DIV_ROUND_UP(dev->data_size, PAGE_SIZE);
+    radix_tree_for_each_slot(slot, &asgn1_locked_store(dev)->page_tree, &iter, 0) {
+        if (iter.index >= last)
+            break;
+        if (nr > 0 && (iter.index != first + nr || nr == SAVE_BATCH)) {
+            result = asgn1_save_run(file, bvec, nr, first);
+            for (i = 0; i < nr; i++) {
+                if (bounce[i] != NULL)
+                    __free_page(bounce[i]);
+                bounce[i] = NULL;
+            }
+            nr = 0;
+            if (result < 0)
+                break;
+        }
+        if (nr == 0)
+            first = iter.index;
+        curr = rcu_dereference_raw(*slot);
+        bvec[nr].bv_page = curr->page;
+        if (curr->page == NULL) {
+            bounce[nr] = alloc_page(GFP_KERNEL);
+            if (bounce[nr] == NULL) {
+                result = -ENOMEM;
+                break;
+            }
+            result = asgn1_unzip(curr, bounce[nr]);
+            if (result < 0)
+                break;
+            bvec[nr].bv_page = bounce[nr];
+        }
+        bvec[nr].bv_len = PAGE_SIZE;
+        bvec[nr].bv_offset = 0;
+        nr++;
+    }
+    if (result == 0 && nr > 0)
+        result = asgn1_save_run(file, bvec, nr, first);
+    for (i = 0; i < SAVE_BATCH; i++) {
+        if (bounce[i] != NULL)
+            __free_page(bounce[i]);
+    }
+
+    // the header goes last, so a file cut short by a crash is rejected
+    if (result == 0)
+        result = asgn1_write_hdr(file, dev->data_size);
+    asgn1_unlock_range(dev, &range);
+    if (result == 0)
+        result = vfs_fsync(file, 0);
+
+out:
+    kfree(bounce);
+    kfree(bvec);
+    filp_close(file, NULL);
+
+    return result;
+}
+
+/**
+ * This function reads nr consecutive pages of the disk from first out of the
+ * backing file with one call, straight into the pages. Whatever lies past
+ * the end of the file is left zeroed.
+ */
+static int asgn1_restore_run(asgn1_dev *dev, struct file *file, struct bio_vec *bvec,
+                             unsigned int nr, unsigned long first) {
+
+    struct iov_iter iter;
+    loff_t pos = PAGE_SIZE + ((loff_t)first << PAGE_SHIFT);
+    page_node *curr;
+    range_lock range;
+    ssize_t result;
+    unsigned int i;
+
+    asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                     (loff_t)(first + nr) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    result = asgn1_fill_holes(dev, first, first + nr - 1, NUMA_NO_NODE);
+    for (i = 0; result == 0 && i < nr; i++) {
+        curr = asgn1_get_node(dev, first + i);
+        if (IS_ERR(curr)) {
+            result = PTR_ERR(curr);
+            break;
+        }
+        bvec[i].bv_page = curr->page;
+        bvec[i].bv_len = PAGE_SIZE;
+        bvec[i].bv_offset = 0;
+    }
+    if (result == 0) {
+        iov_iter_bvec(&iter, ITER_BVEC | READ, bvec, nr, nr * PAGE_SIZE);
+        result = vfs_iter_read(file, &iter, &pos, 0);
+    }
+    for (i = 0; checksum && result >= 0 && i < nr; i++) {
+        rcu_read_lock();
+        curr = radix_tree_lookup(asgn1_tree(dev), first + i);
+        rcu_read_unlock();
+        asgn1_set_crc(curr);
+    }
+    asgn1_unlock_range(dev, &range);
+
+    return result < 0 ? result : 0;
+}
+
+/**
+ * This function restores one slice of a disk, reading each run of data in
+ * the backing file, found with SEEK_DATA and SEEK_HOLE, in SAVE_BATCH pages
+ * at a time.
+ */
+static void asgn1_restore_work(struct work_struct *work) {
+
+    asgn1_restore *slice = container_of(work, asgn1_restore, work);
+    struct bio_vec *bvec;
+    loff_t pos = slice->start, data, hole;
+    unsigned long index, end;
+    unsigned int nr;
+    int result = 0;
+
+    bvec = kmalloc_array(SAVE_BATCH, sizeof(*bvec), GFP_KERNEL);
+    if (bvec == NULL) {
+        slice->result = -ENOMEM;
+        return;
+    }
+
+    while (result == 0 && pos < slice->end) {
+        data = vfs_llseek(slice->file, PAGE_SIZE + pos, SEEK_DATA);
+        // nothing but holes left
+        if (data == -ENXIO)
+            break;
+        if (data < 0) {
+            result = data;
+            break;
+        }
+        data -= PAGE_SIZE;
+        if (data >= slice->end)
+            break;
+        hole = vfs_llseek(slice->file, PAGE_SIZE + data, SEEK_HOLE);
+        if (hole < 0) {
+            result = hole;
+            break;
+        }
+        hole = min(hole - PAGE_SIZE, slice->end);
+
+        end = DIV_ROUND_UP(hole, PAGE_SIZE);
+        for (index = data >> PAGE_SHIFT; result == 0 && index < end; index += nr) {
+            nr = min_t(unsigned long, SAVE_BATCH, end - index);
+            result = asgn1_restore_run(slice->dev, slice->file, bvec, nr, index);
+            cond_resched();
+        }
+        pos = (loff_t)end << PAGE_SHIFT;
+    }
+    kfree(bvec);
+    slice->result = result;
+}
+
+/**
+ * This function restores a disk from its backing file on load, before it is
+ * visible to anyone. The disk is split into one slice per online CPU, whole
+ * chunks each, restored in parallel. A disk that can't be restored is
+ * left empty. Returns -ENOENT if there was nothing to restore, or -EINVAL
+ * if the backing file is not a saved disk.
+ */
+static int __init asgn1_restore_device(asgn1_dev *dev, int index) {
+
+    asgn1_restore *slices = NULL;
+    struct file *file;
+    asgn1_save_hdr hdr;
+    loff_t pos = 0, size = 0, slice_size = 0;
+    int nr = 0, i;
+    int result = 0;
+
+    file = asgn1_open_backing(index, O_RDONLY);
+    if (IS_ERR(file)) {
+        // nothing saved yet
+        if (PTR_ERR(file) != -ENOENT)
+            printk(KERN_WARNING "asgn1: %s%d: can't open backing file (%ld)\n",
+                   MYDEV_NAME, index, PTR_ERR(file));
+        return PTR_ERR(file);
+    }
+
+    if (kernel_read(file, &hdr, sizeof(hdr), &pos) != sizeof(hdr) ||
+        memcmp(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        le32_to_cpu(hdr.version) != SAVE_VERSION || le32_to_cpu(hdr.page_size) != PAGE_SIZE ||
+        le64_to_cpu(hdr.data_size) > LLONG_MAX - CHUNK_SIZE) {
+        printk(KERN_WARNING "asgn1: %s%d: backing file is not a saved disk\n", MYDEV_NAME, index);
+        // nothing was restored, so there is nothing to undo
+        filp_close(file, NULL);
+        return -EINVAL;
+    }
+    size = round_up(le64_to_cpu(hdr.data_size), PAGE_SIZE);
+
+    if (size > 0) {
+        slice_size = round_up(DIV_ROUND_UP_ULL(size, num_online_cpus()), CHUNK_SIZE);
+        nr = DIV_ROUND_UP_ULL(size, slice_size);
+        slices = kcalloc(nr, sizeof(*slices), GFP_KERNEL);
+        if (slices == NULL) {
+            result = -ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0; i < nr; i++) {
+        INIT_WORK(&slices[i].work, asgn1_restore_work);
+        slices[i].dev = dev;
+        slices[i].file = file;
+        slices[i].start = i * slice_size;
+        slices[i].end = min(size, (i + 1) * slice_size);
+        queue_work(system_unbound_wq, &slices[i].work);
+    }
+    for (i = 0; i < nr; i++) {
+        flush_work(&slices[i].work);
+        if (slices[i].result < 0)
+            result = slices[i].result;
+    }
+    kfree(slices);
+
+out:
+    if (result < 0) {
+        printk(KERN_WARNING "asgn1: %s%d: can't restore from backing file (%d)\n",
+               MYDEV_NAME, index, result);
+        free_memory_pages(dev);
+    }
+    else if (size > 0) {
+        asgn1_grow(dev, le64_to_cpu(hdr.data_size));
+        printk(KERN_INFO "asgn1: %s%d: restored %d pages, %llu bytes\n",
+               MYDEV_NAME, index, dev->num_pages, le64_to_cpu(hdr.data_size));
+    }
+    filp_close(file, NULL);
+
+    return result;
+}
+
+/**
+ * This function drops what the backing file holds of a store emptied since
+ * the last flush, which would otherwise come back on load. The caller must
+ * hold wb_mutex. If the truncate fails, the next flush tries it again.
+ */
+static int asgn1_wb_truncate(asgn1_dev *dev) {
+
+    bool truncated;
+    int result;
+
+    spin_lock(&dev->lock);
+    truncated = dev->wb_truncated;
+    dev->wb_truncated = false;
+    spin_unlock(&dev->lock);
+    if (!truncated)
+        return 0;
+
+    result = vfs_truncate(&dev->wb_file->f_path, PAGE_SIZE);
+    if (result < 0)
+        WRITE_ONCE(dev->wb_truncated, true);
+    return result;
+}
+
+/**
+ * This function writes behind the dirty pages among the SAVE_BATCH pages
+ * from first, coalescing consecutive pages into one write. They are
+ * gathered under the range lock, so no write to them is half done, and each
+ * is write-protected in any mapping before its tag is cleared, so a later
+ * write through the mapping faults and tags it again, see asgn1_vma_mkwrite.
+ * They are written out once the lock is dropped, from references we hold.
+ */
+static int asgn1_flush_batch(asgn1_dev *dev, unsigned long first, asgn1_flush_buf *buf) {
+
+    struct address_space *mapping = &dev->mapping;
+    struct radix_tree_iter iter;
+    struct page *page;
+    range_lock range;
+    unsigned int nr = 0, i, run;
+    u64 start, bytes = 0;
+    void **slot;
+    int result = 0;
+
+    asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                     (loff_t)(first + SAVE_BATCH) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+
+    // what the file holds of an emptied store would come back on load, so
+    // it goes before the first page of the new store is written
+    result = asgn1_wb_truncate(dev);
+    if (result < 0) {
+        asgn1_unlock_range(dev, &range);
+        return result;
+    }
+
+    rcu_read_lock();
+    radix_tree_for_each_tagged(slot, asgn1_tree(dev), &iter, first, DIRTY_TAG) {
+        if (iter.index >= first + SAVE_BATCH)
+            break;
+        buf->index[nr] = iter.index;
+        buf->nodes[nr] = radix_tree_deref_slot(slot);
+        nr++;
+    }
+    rcu_read_unlock();
+
+    for (i = 0; i < nr; i++) {
+        page = buf->nodes[i]->page;
+        if (page != NULL) {
+            // a fault making the page writable holds its lock until mapped
+            lock_page(page);
+            unmap_mapping_range(mapping, (loff_t)buf->index[i] << PAGE_SHIFT, PAGE_SIZE, 0);
+            asgn1_clear_dirty(dev, buf->index[i]);
+            // write-protected again, so its checksum can be trusted again
+            if (checksum && !buf->nodes[i]->crc_ok)
+                asgn1_reset_crc(buf->nodes[i]);
+            unlock_page(page);
+            get_page(page);
+        }
+        else {
+            // compressed pages are never mapped
+            page = alloc_page(GFP_KERNEL);
+            if (page == NULL) {
+                result = -ENOMEM;
+                break;
+            }
+            result = asgn1_unzip(buf->nodes[i], page);
+            if (result < 0) {
+                __free_page(page);
+                break;
+            }
+            asgn1_clear_dirty(dev, buf->index[i]);
+        }
+        buf->bvec[i].bv_page = page;
+        buf->bvec[i].bv_len = PAGE_SIZE;
+        buf->bvec[i].bv_offset = 0;
+    }
+    nr = i;
+    asgn1_unlock_range(dev, &range);
+
+    start = ktime_get_ns();
+    for (i = 0; result == 0 && i < nr; i += run) {
+        for (run = 1; i + run < nr && buf->index[i + run] == buf->index[i] + run; run++)
+            ;
+        result = asgn1_save_run(dev->wb_file, &buf->bvec[i], run, buf->index[i]);
+        if (result == 0)
+            bytes += run * PAGE_SIZE;
+    }
+    WRITE_ONCE(dev->flush_ns, dev->flush_ns + ktime_get_ns() - start);
+    WRITE_ONCE(dev->flushed_bytes, dev->flushed_bytes + bytes);
+
+    // pages that did not make it to the file are flushed again next time
+    if (result < 0 && nr > 0) {
+        asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                         (loff_t)(first + SAVE_BATCH) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+        for (i = 0; i < nr; i++)
+            asgn1_mark_dirty(dev, buf->index[i]);
+        asgn1_unlock_range(dev, &range);
+    }
+    for (i = 0; i < nr; i++)
+        put_page(buf->bvec[i].bv_page);
+
+    return result;
+}
+
+/**
+ * This function writes every page dirty when it is called behind to the
+ * backing file, followed by the header with the current size of the disk.
+ */
+static int asgn1_flush(asgn1_dev *dev) {
+
+    struct radix_tree_iter iter;
+    asgn1_flush_buf *buf;
+    unsigned long index = 0;
+    bool found;
+    void **slot;
+    int result = 0;
+
+    buf = kmalloc(sizeof(*buf), GFP_KERNEL);
+    if (buf == NULL)
+        return -ENOMEM;
+
+    mutex_lock(&dev->wb_mutex);
+    for (;;) {
+        found = false;
+        rcu_read_lock();
+        radix_tree_for_each_tagged(slot, asgn1_tree(dev), &iter, index, DIRTY_TAG) {
+            index = iter.index;
+            found = true;
+            break;
+        }
+        rcu_read_unlock();
+        if (!found)
+            break;
+        result = asgn1_flush_batch(dev, index, buf);
+        if (result < 0)
+            break;
+        index += SAVE_BATCH;
+        cond_resched();
+    }
+    // with no page dirty, an emptied store is still in the file, and the
+    // new size would bring it back
+    if (result == 0)
+        result = asgn1_wb_truncate(dev);
+    if (result == 0)
+        result = asgn1_write_hdr(dev->wb_file, smp_load_acquire(&dev->data_size));
+    mutex_unlock(&dev->wb_mutex);
+    kfree(buf);
+
+    return result;
+}
+
+/**
+ * This function waits until everything written to the disk so far is in the
+ * backing file and on stable storage, as fsync does for a file. Returns
+ * -EINVAL if the disk is not written behind.
+ */
+static int asgn1_sync(asgn1_dev *dev) {
+
+    int result;
+
+    if (dev->wb_file == NULL)
+        return -EINVAL;
+    result = asgn1_flush(dev);
+    if (result == 0)
+        result = vfs_fsync(dev->wb_file, 0);
+    return result;
+}
+
+/**
+ * This function writes dirty pages behind every flush_secs.
+ */
+static void asgn1_flush_work(struct work_struct *work) {
+
+    asgn1_dev *dev = container_of(to_delayed_work(work), asgn1_dev, flush_work);
+    int result;
+
+    result = asgn1_sync(dev);
+    if (result < 0)
+        printk(KERN_WARNING "asgn1: %s%d: write-behind failed (%d)\n",
+               MYDEV_NAME, MINOR(dev->dev), result);
+
+    queue_delayed_work(system_long_wq, &dev->flush_work, flush_secs * HZ);
+}
+
+/**
+ * This function opens the virtual disk, if it is opened in the write-only
+ * mode, all memory pages will be freed.
+ */
+int asgn1_open(struct inode *inode, struct file *filp) {
+
+    asgn1_dev *dev = container_of(inode->i_cdev, asgn1_dev, cdev);
+    int max_num_procs = atomic_read(&dev->max_nprocs);
+    range_lock range;
+    int result;
+
+    pr_debug("asgn1: asgn1_open called\n");
+
+    filp->private_data = dev;
+    // one mapping for every device node, so unmapping the device reaches them all
+    filp->f_mapping = &dev->mapping;
+    // reads and writes honour IOCB_NOWAIT
+    filp->f_mode |= FMODE_NOWAIT;
+    
+    if (atomic_inc_return(&dev->nprocs) > max_num_procs && max_num_procs > 0) {
+        atomic_dec(&dev->nprocs);
+        asgn1_count(dev, open_busy, 1);
+        printk(KERN_WARNING "asgn1: Device already in use!\n");
+        return -EBUSY;
+    }
+    
+    pr_debug("asgn1: Process count incremented to %d\n", atomic_read(&dev->nprocs));
+
+    // If opened in write-only
+    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+        pr_debug("asgn1: Opened in write-only\n");
+        result = asgn1_lock_range(dev, &range, 0, LLONG_MAX, TASK_INTERRUPTIBLE);
+        if (result < 0) {
+            atomic_dec(&dev->nprocs);
+            return result;
+        }
+        result = free_memory_pages(dev);
+        // mappings must not keep writing to the pages just let go
+        if (result == 0)
+            unmap_mapping_range(&dev->mapping, 0, 0, 0);
+        asgn1_unlock_range(dev, &range);
+        if (result < 0) {
+            atomic_dec(&dev->nprocs);
+            return result;
+        }
+    }
+    
+    pr_debug("asgn1: asgn1_open finished\n");
+
+    return 0;
+}
+
+/**
+ * This function releases the virtual disk, but nothing needs to be done
+ * in this case. 
+ */
+int asgn1_release (struct inode *inode, struct file *filp) {
+
+    asgn1_dev *dev = filp->private_data;
+
+    pr_debug("asgn1: asgn1_release called\n");
+    
+    atomic_dec(&dev->nprocs);
+    pr_debug("asgn1: Process count decremented to %d\n", atomic_read(&dev->nprocs));
+
+    pr_debug("asgn1: asgn1_release finished\n");
+
+    return 0;
+}
+
+/**
+ * This function copies count bytes at pos out of the virtual disk into to,
+ * holes reading as zeroes. No locks are taken, pages are found through RCU
+ * and held by reference while they are copied out. A compressed page stops
+ * the read with -EAGAIN instead if nowait is set. A page that fails its
+ * checksum stops it with -EIO. Returns the size copied, or an error if
+ * nothing could be.
+ */
+static ssize_t asgn1_read_pages(asgn1_dev *dev, loff_t pos, size_t count, struct iov_iter *to, bool nowait) {
+
+    size_t size_read = 0;                     /* size read from virtual disk in this function */
+    size_t begin_offset = pos % PAGE_SIZE;    /* the offset from the beginning of a page to start reading */
+    unsigned long begin_page_no = pos / PAGE_SIZE; /* the first page which contains the requested data */
+    size_t curr_size_read;                    /* size read from the virtual disk in this round */
+    size_t size_to_read;                      /* size to read in the current round */
+    struct page *page;                        /* the current page, NULL for a hole */
+    int error = -EFAULT;                      /* returned if nothing could be read */
+    int result;
+
+    // look up each page by number, reading its contents; holes read as zeroes
+    while (size_read < count) {
+        page = asgn1_get_page_rcu(dev, begin_page_no, nowait ? GET_NOWAIT : 0);
+        if (IS_ERR(page)) {
+            error = PTR_ERR(page);
+            break;
+        }
+        if (page != NULL) {
+            result = asgn1_verify_page(dev, begin_page_no, page, nowait);
+            if (result < 0) {
+                put_page(page);
+                error = result;
+                break;
+            }
+        }
+        size_to_read = min_t(size_t, PAGE_SIZE - begin_offset, count - size_read);
+        curr_size_read = copy_page_to_iter(page != NULL ? page : ZERO_PAGE(0), begin_offset, size_to_read, to);
+        if (page != NULL)
+            put_page(page);
+        size_read += curr_size_read;
+        trace_asgn1_read_page(MINOR(dev->dev), begin_page_no, begin_offset, size_to_read, curr_size_read);
+        // stop on a faulting user buffer
+        if (curr_size_read != size_to_read)
+            break;
+        begin_page_no++;  // go to next page
+        begin_offset = 0; // offset at start of page
+    }
+
+    if (size_read == 0 && count > 0)
+        return error;
+    return size_read;
+}
+
+/**
+ * This function reads contents of the virtual disk into the caller's
+ * buffers, which may be scattered across any number of iovec segments.
+ * With IOCB_NOWAIT, as from RWF_NOWAIT or aio, it completes inline unless
+ * it meets a compressed page.
+ */
+ssize_t asgn1_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    asgn1_dev *dev = iocb->ki_filp->private_data;
+
+    size_t count = iov_iter_count(to);        /* size requested over all segments */
+    size_t data_size;                         /* the data size when the read started */
+    ssize_t result = 0;
+    u64 start = ktime_get_ns();               /* when the read started */
+
+    data_size = smp_load_acquire(&dev->data_size);
+    if (iocb->ki_pos < data_size)
+        result = asgn1_read_pages(dev, iocb->ki_pos, min(count, data_size - (size_t)iocb->ki_pos), to,
+                                  iocb->ki_flags & IOCB_NOWAIT);
+
+    trace_asgn1_read(MINOR(dev->dev), iocb->ki_pos, count, result);
+    asgn1_count(dev, read_ops, 1);
+    asgn1_count_lat(dev, read_lat, start);
+
+    if (result > 0) {
+        asgn1_count(dev, read_bytes, result);
+        iocb->ki_pos += result;
+    }
+    else if (result == -EAGAIN) {
+        asgn1_count(dev, nowait_again, 1);
+    }
+    return result;
+}
+
+/**
+ * Pipe buffers that reference pages of the virtual disk. They must never be
+ * merged into or stolen, since the page still belongs to the disk.
+ */
+static const struct pipe_buf_operations asgn1_pipe_buf_ops = {
+    .can_merge = 0,
+    .confirm = generic_pipe_buf_confirm,
+    .release = generic_pipe_buf_release,
+    .steal = generic_pipe_buf_nosteal,
+    .get = generic_pipe_buf_get,
+};
+
+static void asgn1_spd_release(struct splice_pipe_desc *spd, unsigned int i) {
+
+    put_page(spd->pages[i]);
+}
+
+/**
+ * This function splices contents of the virtual disk into a pipe without
+ * copying, by handing the pipe references to the disk's own pages. This is
+ * what sendfile() and splice() out of the disk use. Like the page cache, a
+ * later write to the disk is seen by whoever still has the page in a pipe.
+ */
+static ssize_t asgn1_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                                 size_t len, unsigned int flags) {
+
+    asgn1_dev *dev = filp->private_data;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &asgn1_pipe_buf_ops,
+        .spd_release = asgn1_spd_release,
+    };
+    size_t data_size = smp_load_acquire(&dev->data_size);
+    loff_t pos = *ppos;
+    struct page *page;
+    size_t offset, size;
+    ssize_t result;
+    u64 start = ktime_get_ns();
+
+    if (pos >= data_size)
+        return 0;
+    len = min_t(size_t, len, data_size - pos);
+
+    // gather references to the pages, holes are spliced from the zero page
+    while (len > 0 && spd.nr_pages < spd.nr_pages_max) {
+        page = asgn1_get_page_rcu(dev, pos >> PAGE_SHIFT, 0);
+        if (!IS_ERR_OR_NULL(page)) {
+            result = asgn1_verify_page(dev, pos >> PAGE_SHIFT, page, false);
+            if (result < 0) {
+                put_page(page);
+                page = ERR_PTR(result);
+            }
+        }
+        if (IS_ERR(page)) {
+            if (spd.nr_pages == 0)
+                return PTR_ERR(page);
+            break;
+        }
+        if (page == NULL) {
+            page = ZERO_PAGE(0);
+            get_page(page);
+        }
+        offset = pos & ~PAGE_MASK;
+        size = min_t(size_t, PAGE_SIZE - offset, len);
+        pages[spd.nr_pages] = page;
+        partial[spd.nr_pages].offset = offset;
+        partial[spd.nr_pages].len = size;
+        spd.nr_pages++;
+        pos += size;
+        len -= size;
+    }
+
+    result = splice_to_pipe(pipe, &spd);
+    trace_asgn1_splice_read(MINOR(dev->dev), *ppos, pos - *ppos, result);
+    asgn1_count(dev, read_ops, 1);
+    asgn1_count_lat(dev, read_lat, start);
+    if (result > 0) {
+        asgn1_count(dev, read_bytes, result);
+        *ppos += result;
+    }
+
+    return result;
+}
+
+static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd) {
+    
+    asgn1_dev *dev = file->private_data;
+    loff_t testpos;
+    size_t buffer_size = smp_load_acquire(&dev->data_size);
+    long index;
+
+    pr_debug("asgn1: asgn1_leek called\n");
+    
+    switch(cmd) {
+    case SEEK_SET:
+        testpos = offset;
+        break;
+    case SEEK_CUR:
+        testpos = file->f_pos + offset;
+        break;
+    case SEEK_END:
+        testpos = buffer_size + offset;
+        break;
+    case SEEK_DATA:
+        if (offset < 0 || offset >= buffer_size)
+            return -ENXIO;
+        index = asgn1_next_data(dev, offset >> PAGE_SHIFT);
+        if (index < 0 || ((loff_t)index << PAGE_SHIFT) >= buffer_size)
+            return -ENXIO;
+        testpos = max(offset, (loff_t)index << PAGE_SHIFT);
+        break;
+    case SEEK_HOLE:
+        if (offset < 0 || offset >= buffer_size)
+            return -ENXIO;
+        index = asgn1_next_hole(dev, offset >> PAGE_SHIFT);
+        testpos = min(max(offset, (loff_t)index << PAGE_SHIFT), (loff_t)buffer_size);
+        break;
+    default:
+        return -EINVAL;
+    }
+    
+    // seeking past the end is allowed, a later write leaves a hole behind it
+    if (testpos < 0)
+        testpos = 0;
+
+    file->f_pos = testpos;
+    
+    pr_debug("asgn1: Seeking to pos=%ld\n", (long)testpos);
+    
+    return testpos;
+}
+
+/**
+ * This function returns whether the pages first to last inclusive can all be
+ * written without allocating anything: none is a hole, compressed, shared
+ * or still seen by a snapshot. The caller must hold a range lock covering
+ * them.
+ */
+static bool asgn1_pages_ready(asgn1_dev *dev, unsigned long first, unsigned long last) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    page_node *curr;
+    unsigned long index;
+    bool ready = true;
+
+    rcu_read_lock();
+    for (index = first; ready && index <= last; index++) {
+        curr = radix_tree_lookup(&store->page_tree, index);
+        ready = curr != NULL && curr->page != NULL && curr->dup == NULL && curr->gen == store->gen;
+    }
+    rcu_read_unlock();
+
+    return ready;
+}
+
+/**
+ * This function writes all of from to the virtual disk at pos, waiting for
+ * overlapping writers in the given task state. If nowait is set it waits
+ * for nothing instead: the write fails with -EAGAIN unless the range is free
+ * and every page in it is ready to be written, and isn't deduplicated.
+ * The range is dropped while a buffer that isn't resident is faulted in,
+ * so such a write may be seen in parts. Returns the size written, or an
+ * error if nothing could be.
+ */
+static ssize_t asgn1_write_pages(asgn1_dev *dev, loff_t pos, struct iov_iter *from, int state, bool nowait) {
+
+    size_t count = iov_iter_count(from);      /* size to write over all segments */
+    size_t size_written = 0;                  /* size written to virtual disk in this function */
+    size_t begin_offset = pos % PAGE_SIZE;    /* the offset from the beginning of a page to start writing */
+    unsigned long begin_page_no = pos / PAGE_SIZE; /* the first page this function should start writing to */
+    size_t curr_size_written;                 /* size written to virtual disk in this round */
+    size_t size_to_write;                     /* size to write in the current round */
+    bool crc_update;                          /* CRC updated from the bytes written, not recomputed */
+    u32 old_crc = 0;                          /* CRC of the bytes about to be overwritten */
+    page_node *curr;                          /* the node of the current page */
+    range_lock range;                         /* the range this write covers */
+    int error = -EFAULT;                      /* returned if nothing could be written */
+    int result;
+
+    // only writers to overlapping ranges wait for each other
+    if (nowait)
+        result = asgn1_trylock_range(dev, &range, pos, pos + count);
+    else
+        result = asgn1_lock_range(dev, &range, pos, pos + count, state);
+    if (result < 0)
+        return result;
+
+    if (nowait && count > 0 && !asgn1_pages_ready(dev, begin_page_no, (pos + count - 1) / PAGE_SIZE)) {
+        asgn1_unlock_range(dev, &range);
+        return -EAGAIN;
+    }
+      
+    // allocate the holes this write covers in blocks up front
+    if (count > 0 && !nowait)
+        asgn1_fill_holes(dev, begin_page_no, (pos + count - 1) / PAGE_SIZE, NUMA_NO_NODE);
+
+    // look up each page by number, writing to it; only pages written to
+    // are allocated, anything skipped over stays a hole
+    while (size_written < count) {
+        curr = asgn1_get_node(dev, begin_page_no);
+        if (IS_ERR(curr)) {
+            error = PTR_ERR(curr);
+            break;
+        }
+        size_to_write = min_t(size_t, PAGE_SIZE - begin_offset, count - size_written);
+        // a small write is cheaper to checksum by what it changes
+        crc_update = checksum && READ_ONCE(curr->crc_ok) && 2 * size_to_write < PAGE_SIZE;
+        if (crc_update)
+            old_crc = asgn1_span_crc(curr->page, begin_offset, size_to_write);
+        // the buffer may be a mapping of this device, whose fault handler
+        // would wait for the range held here, so copy without faulting
+        pagefault_disable();
+        curr_size_written = iov_iter_copy_from_user_atomic(curr->page, from, begin_offset, size_to_write);
+        pagefault_enable();
+        iov_iter_advance(from, curr_size_written);
+        size_written += curr_size_written;
+        trace_asgn1_write_page(MINOR(dev->dev), begin_page_no, begin_offset, size_to_write, curr_size_written);
+        if (curr_size_written > 0) {
+            if (crc_update && curr_size_written == size_to_write)
+                asgn1_update_crc(curr, begin_offset, size_to_write, old_crc);
+            else
+                asgn1_set_crc(curr);
+            asgn1_mark_dirty(dev, begin_page_no);
+        }
+        // and fault the buffer in with the range dropped, stopping if it
+        // can't be
+        if (curr_size_written != size_to_write) {
+            if (nowait) {
+                error = -EAGAIN;
+                break;
+            }
+            asgn1_grow(dev, pos + size_written);
+            asgn1_unlock_range(dev, &range);
+            if (iov_iter_fault_in_readable(from, size_to_write - curr_size_written))
+                goto out;
+            result = asgn1_lock_range(dev, &range, pos + size_written, pos + count, state);
+            if (result < 0) {
+                error = result;
+                goto out;
+            }
+            begin_offset += curr_size_written;
+            continue;
+        }
+        // only whole pages are worth looking for a twin of
+        if (dedup && !nowait && size_to_write == PAGE_SIZE)
+            asgn1_dedup_node(dev, curr);
+        begin_page_no++;  // go to next page
+        begin_offset = 0; // offset at start of page
+    }
+
+    asgn1_grow(dev, pos + size_written);
+
+    asgn1_unlock_range(dev, &range);
+    
+out:
+    if (size_written == 0 && count > 0)
+        return error;
+    return size_written;
+}
+
+/**
+ * This function writes from the caller's buffers, which may be scattered
+ * across any number of iovec segments, to the virtual disk of this module.
+ * With IOCB_NOWAIT it completes inline if it needn't wait for another
+ * writer or allocate, and fails with -EAGAIN otherwise.
+ */
+ssize_t asgn1_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+
+    asgn1_dev *dev = iocb->ki_filp->private_data;
+
+    size_t count = iov_iter_count(from);      /* size to write over all segments */
+    ssize_t result;
+    u64 start = ktime_get_ns();               /* when the write started, including lock waits */
+
+    result = asgn1_write_pages(dev, iocb->ki_pos, from, TASK_INTERRUPTIBLE, iocb->ki_flags & IOCB_NOWAIT);
+
+    trace_asgn1_write(MINOR(dev->dev), iocb->ki_pos, count, result);
+    asgn1_count(dev, write_ops, 1);
+    asgn1_count_lat(dev, write_lat, start);
+
+    if (result > 0) {
+        asgn1_count(dev, write_bytes, result);
+        iocb->ki_pos += result;
+    }
+    else if (result == -EAGAIN) {
+        asgn1_count(dev, nowait_again, 1);
+    }
+    return result;
+}
+
+/**
+ * This function reserves the range of an ASGN1_PREALLOC request, much like
+ * fallocate: every page in it is allocated, decompressed and unshared up
+ * front, so later writes to the range never call the allocator. It needs
+ * the device open for writing.
+ */
+static long asgn1_preallocate(asgn1_dev *dev, struct file *filp, struct asgn1_prealloc __user *arg) {
+
+    struct asgn1_prealloc req;
+    unsigned long first, last, index;
+    size_t offset, len;
+    page_node *curr;
+    range_lock range;
+    int result;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.flags & ~(ASGN1_PREALLOC_KEEP_SIZE | ASGN1_PREALLOC_ZERO))
+        return -EINVAL;
+    if (req.length == 0 || req.offset > LLONG_MAX || req.length > LLONG_MAX - req.offset)
+        return -EINVAL;
+    if (req.node != NUMA_NO_NODE &&
+        (req.node < 0 || req.node >= MAX_NUMNODES || !node_online(req.node)))
+        return -EINVAL;
+
+    first = req.offset >> PAGE_SHIFT;
+    last = (req.offset + req.length - 1) >> PAGE_SHIFT;
+
+    result = asgn1_lock_range(dev, &range, req.offset, req.offset + req.length, TASK_INTERRUPTIBLE);
+    if (result < 0)
+        return result;
+
+    // allocate the holes in blocks, then make sure every page is ours
+    result = asgn1_fill_holes(dev, first, last, req.node);
+    for (index = first; result == 0 && index <= last; index++) {
+        curr = asgn1_get_node(dev, index);
+        if (IS_ERR(curr)) {
+            result = PTR_ERR(curr);
+            break;
+        }
+        if (req.flags & ASGN1_PREALLOC_ZERO) {
+            offset = index == first ? req.offset & ~PAGE_MASK : 0;
+            len = index == last ? ((req.offset + req.length - 1) & ~PAGE_MASK) + 1 : PAGE_SIZE;
+            zero_user_segment(curr->page, offset, len);
+            asgn1_set_crc(curr);
+            asgn1_mark_dirty(dev, index);
+        }
+        if (fatal_signal_pending(current))
+            result = -EINTR;
+        cond_resched();
+    }
+
+    if (result == 0 && !(req.flags & ASGN1_PREALLOC_KEEP_SIZE))
+        asgn1_grow(dev, req.offset + req.length);
+    asgn1_unlock_range(dev, &range);
+
+    return result;
+}
+
+/**
+ * This function switches whether a device fills its holes a whole
+ * physically contiguous chunk at a time. That is only allowed while the
+ * device is empty, and needs the device open for writing.
+ */
+static long asgn1_set_contig(asgn1_dev *dev, struct file *filp, int __user *arg) {
+
+    range_lock range;
+    int on;
+    int result;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (get_user(on, arg))
+        return -EFAULT;
+
+    result = asgn1_lock_range(dev, &range, 0, LLONG_MAX, TASK_INTERRUPTIBLE);
+    if (result < 0)
+        return result;
+    if (dev->num_pages > 0)
+        result = -EBUSY;
+    else
+        WRITE_ONCE(dev->contig, on != 0);
+    asgn1_unlock_range(dev, &range);
+
+    return result;
+}
+
+/**
+ * This function zeroes the bytes [from, to) of a page of the disk that a
+ * punch or truncate only partly covers. A hole is left as it is. The caller
+ * must hold a range lock covering the whole page.
+ */
+static int asgn1_zero_partial(asgn1_dev *dev, unsigned long index, size_t from, size_t to) {
+
+    page_node *curr;
+
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    rcu_read_unlock();
+    if (curr == NULL)
+        return 0;
+
+    curr = asgn1_get_node(dev, index);
+    if (IS_ERR(curr))
+        return PTR_ERR(curr);
+    zero_user_segment(curr->page, from, to);
+    asgn1_set_crc(curr);
+    asgn1_mark_dirty(dev, index);
+
+    return 0;
+}
+
+/**
+ * This function takes nr nodes, at most FREE_BATCH, out of the page index
+ * and frees them with their pages. The caller must hold a range lock
+ * covering them and have given any snapshot that still sees one a copy.
+ * If frozen is set, their pages were frozen by the caller to keep lockless
+ * readers off them, see asgn1_discard_batch.
+ */
+static void asgn1_delete_nodes(asgn1_dev *dev, unsigned long *indices, page_node **nodes, unsigned int nr,
+                               bool frozen) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    struct radix_tree_root *tree;
+    struct page *pages[FREE_BATCH];
+    dedup_page *dup;
+    unsigned int i;
+
+    if (nr == 0)
+        return;
+
+    spin_lock(&dev->lock);
+    tree = asgn1_tree(dev);
+    for (i = 0; i < nr; i++) {
+        if (radix_tree_tag_get(tree, indices[i], DIRTY_TAG))
+            dev->num_dirty--;
+        if (radix_tree_tag_get(tree, indices[i], DISCARD_TAG))
+            dev->num_discard--;
+        radix_tree_delete(tree, indices[i]);
+        if (nodes[i]->page == NULL) {
+            dev->num_zpages--;
+            dev->zbytes -= nodes[i]->zlen;
+        }
+    }
+    dev->num_pages -= nr;
+    spin_unlock(&dev->lock);
+
+    // a reader that finds the page again now sees it is no longer indexed
+    for (i = 0; frozen && i < nr; i++) {
+        if (nodes[i]->page != NULL)
+            page_ref_unfreeze(nodes[i]->page, 1);
+    }
+
+    // each node holds its own reference to a shared page, only the entry
+    // of the last one goes with it
+    if (store->dedup_table != NULL) {
+        spin_lock(&store->dedup_lock);
+        for (i = 0; i < nr; i++) {
+            dup = nodes[i]->dup;
+            if (dup == NULL)
+                continue;
+            store->dedup_nodes--;
+            if (--dup->refs == 0) {
+                hlist_del(&dup->hash);
+                store->dedup_entries--;
+                kfree(dup);
+            }
+        }
+        spin_unlock(&store->dedup_lock);
+    }
+
+    trace_asgn1_pages_free(MINOR(dev->dev), indices[0], nr, dev->num_pages);
+    asgn1_count(dev, pages_freed, nr);
+    free_node_batch(nodes, pages, nr);
+}
+
+/**
+ * This function frees the pages first to last inclusive, leaving holes, in
+ * time proportional to the pages there rather than to the range. Snapshots
+ * that still see a page are given a copy of it first. The caller must hold
+ * a range lock covering whole pages, and unmaps the range afterwards.
+ */
+static int asgn1_free_range(asgn1_dev *dev, unsigned long first, unsigned long last) {
+
+    asgn1_store *store = asgn1_locked_store(dev);
+    struct radix_tree_iter iter;
+    page_node *nodes[FREE_BATCH], *curr;
+    unsigned long indices[FREE_BATCH], index = first;
+    unsigned int count, nr, i;
+    void **slot;
+    int result = 0;
+
+    while (result == 0 && index <= last) {
+        count = 0;
+        rcu_read_lock();
+        radix_tree_for_each_slot(slot, asgn1_tree(dev), &iter, index) {
+            if (iter.index > last)
+                break;
+            indices[count] = iter.index;
+            nodes[count] = radix_tree_deref_slot(slot);
+            if (++count == FREE_BATCH)
+                break;
+        }
+        rcu_read_unlock();
+        if (count == 0)
+            break;
+        index = indices[count - 1] + 1;
+
+        for (i = 0, nr = 0; result == 0 && i < count; i++) {
+            curr = nodes[i];
+            if (curr->gen != store->gen) {
+                if (curr->page == NULL)
+                    result = asgn1_decompress_node(dev, indices[i], curr);
+                if (result == 0)
+                    result = asgn1_preserve_node(dev, indices[i], curr);
+                if (result < 0)
+                    break;
+            }
+            indices[nr] = indices[i];
+            nodes[nr++] = curr;
+        }
+
+        asgn1_delete_nodes(dev, indices, nodes, nr, false);
+        cond_resched();
+    }
+
+    return result;
+}
+
+/**
+ * This function frees the pages of an ASGN1_PUNCH_HOLE range, leaving a hole
+ * and the size of the disk as it was, much like fallocate with
+ * FALLOC_FL_PUNCH_HOLE. Pages only partly in the range are zeroed. A disk
+ * written behind has the hole punched in its backing file first, so a
+ * failure there leaves the disk untouched.
+ */
+static long asgn1_punch_hole(asgn1_dev *dev, struct file *filp, struct asgn1_range __user *arg) {
+
+    struct asgn1_range req;
+    unsigned long first, last;
+    size_t head, tail;
+    range_lock range;
+    int result;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.length == 0 || req.offset > LLONG_MAX || req.length > LLONG_MAX - req.offset)
+        return -EINVAL;
+
+    first = req.offset >> PAGE_SHIFT;
+    last = (req.offset + req.length - 1) >> PAGE_SHIFT;
+    head = req.offset & ~PAGE_MASK;
+    tail = ((req.offset + req.length - 1) & ~PAGE_MASK) + 1;
+
+    // flushes write from pages they hold after dropping their range lock,
+    // so none may be in flight while the file and the pages go
+    if (dev->wb_file != NULL) {
+        result = mutex_lock_interruptible(&dev->wb_mutex);
+        if (result < 0)
+            return result;
+    }
+    result = asgn1_lock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                              (loff_t)(last + 1) << PAGE_SHIFT, TASK_INTERRUPTIBLE);
+    if (result < 0)
+        goto out;
+
+    if (dev->wb_file != NULL)
+        result = vfs_fallocate(dev->wb_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               PAGE_SIZE + req.offset, req.length);
+    if (result == 0 && first == last && (head > 0 || tail < PAGE_SIZE)) {
+        result = asgn1_zero_partial(dev, first, head, tail);
+    }
+    else if (result == 0) {
+        if (head > 0)
+            result = asgn1_zero_partial(dev, first++, head, PAGE_SIZE);
+        if (result == 0 && tail < PAGE_SIZE)
+            result = asgn1_zero_partial(dev, last--, 0, tail);
+        // faults that found a page before it went may still map it, as
+        // with a truncate
+        if (result == 0 && first <= last) {
+            result = asgn1_free_range(dev, first, last);
+            unmap_mapping_range(&dev->mapping, (loff_t)first << PAGE_SHIFT,
+                                (loff_t)(last - first + 1) << PAGE_SHIFT, 1);
+        }
+    }
+    asgn1_unlock_range(dev, &range);
+
+out:
+    if (dev->wb_file != NULL)
+        mutex_unlock(&dev->wb_mutex);
+    return result;
+}
+
+/**
+ * This function sets the size of the disk for ASGN1_TRUNCATE, as ftruncate
+ * does for a file. Growing it leaves a hole. Shrinking it frees the pages
+ * past the new end and zeroes the rest of the last page, so growing it
+ * again reads zeroes there. A disk written behind has its backing file cut
+ * to match first.
+ */
+static long asgn1_truncate(asgn1_dev *dev, struct file *filp, __u64 __user *arg) {
+
+    range_lock range;
+    loff_t start;
+    u64 size;
+    int result;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (get_user(size, arg))
+        return -EFAULT;
+    if (size > LLONG_MAX)
+        return -EINVAL;
+    start = round_down(size, PAGE_SIZE);
+
+    if (dev->wb_file != NULL) {
+        result = mutex_lock_interruptible(&dev->wb_mutex);
+        if (result < 0)
+            return result;
+    }
+    result = asgn1_lock_range(dev, &range, start, LLONG_MAX, TASK_INTERRUPTIBLE);
+    if (result < 0)
+        goto out;
+
+    if (size >= dev->data_size) {
+        asgn1_grow(dev, size);
+        goto unlock;
+    }
+
+    if (dev->wb_file != NULL) {
+        result = vfs_truncate(&dev->wb_file->f_path, PAGE_SIZE + size);
+        if (result == 0)
+            result = asgn1_write_hdr(dev->wb_file, size);
+        if (result < 0)
+            goto unlock;
+    }
+
+    // shrink the disk first so new readers and faults stop at the new end
+    spin_lock(&dev->lock);
+    smp_store_release(&dev->data_size, size);
+    spin_unlock(&dev->lock);
+
+    if (size > start)
+        result = asgn1_zero_partial(dev, start >> PAGE_SHIFT, size - start, PAGE_SIZE);
+    if (result == 0)
+        result = asgn1_free_range(dev, DIV_ROUND_UP(size, PAGE_SIZE), ULONG_MAX);
+    unmap_mapping_range(&dev->mapping, PAGE_ALIGN(size), 0, 1);
+
+unlock:
+    asgn1_unlock_range(dev, &range);
+out:
+    if (dev->wb_file != NULL)
+        mutex_unlock(&dev->wb_mutex);
+    return result;
+}
+
+/**
+ * This function sets the limit of ASGN1_SET_LIMIT, rounded up to whole
+ * pages. A device already over it keeps its pages, but gets no new ones
+ * until it is back under. Only an administrator may change it.
+ */
+static long asgn1_set_limit(asgn1_dev *dev, __u64 __user *arg) {
+
+    u64 bytes;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (get_user(bytes, arg))
+        return -EFAULT;
+    if (bytes > LLONG_MAX)
+        return -EINVAL;
+
+    spin_lock(&dev->lock);
+    WRITE_ONCE(dev->max_pages, DIV_ROUND_UP_ULL(bytes, PAGE_SIZE));
+    spin_unlock(&dev->lock);
+
+    return 0;
+}
+
+/**
+ * This function marks the pages now in the range of an ASGN1_DISCARDABLE
+ * request as ones the shrinker may drop, or clears the mark again. Only
+ * pages wholly inside the range are marked, but any page it touches is
+ * cleared. It takes time in proportion to the pages there, not the range,
+ * and needs the device open for writing, since dropped pages lose data.
+ */
+static long asgn1_set_discardable(asgn1_dev *dev, struct file *filp, struct asgn1_discard __user *arg) {
+
+    struct asgn1_discard req;
+    struct radix_tree_root *tree;
+    struct radix_tree_iter iter;
+    unsigned long indices[FREE_BATCH], first, end;
+    unsigned int count, i;
+    bool tagged;
+    void **slot;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.discardable > 1 || req.pad != 0)
+        return -EINVAL;
+    if (req.length == 0 || req.offset > LLONG_MAX || req.length > LLONG_MAX - req.offset)
+        return -EINVAL;
+
+    if (req.discardable) {
+        first = DIV_ROUND_UP_ULL(req.offset, PAGE_SIZE);
+        end = (req.offset + req.length) >> PAGE_SHIFT;
+    }
+    else {
+        first = req.offset >> PAGE_SHIFT;
+        end = DIV_ROUND_UP_ULL(req.offset + req.length, PAGE_SIZE);
+    }
+
+    while (first < end) {
+        count = 0;
+        rcu_read_lock();
+        radix_tree_for_each_slot(slot, asgn1_tree(dev), &iter, first) {
+            if (iter.index >= end)
+                break;
+            indices[count] = iter.index;
+            if (++count == FREE_BATCH)
+                break;
+        }
+        rcu_read_unlock();
+        if (count == 0)
+            break;
+        first = indices[count - 1] + 1;
+
+        spin_lock(&dev->lock);
+        tree = asgn1_tree(dev);
+        for (i = 0; i < count; i++) {
+            // the page may have been freed since
+            if (radix_tree_lookup(tree, indices[i]) == NULL)
+                continue;
+            tagged = radix_tree_tag_get(tree, indices[i], DISCARD_TAG);
+            if (req.discardable && !tagged) {
+                radix_tree_tag_set(tree, indices[i], DISCARD_TAG);
+                dev->num_discard++;
+            }
+            else if (!req.discardable && tagged) {
+                radix_tree_tag_clear(tree, indices[i], DISCARD_TAG);
+                dev->num_discard--;
+            }
+        }
+        spin_unlock(&dev->lock);
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/**
+ * This function hashes the bytes of the device from pos to end into desc,
+ * taking no locks, as asgn1_read_pages does, holes hashing as zeroes. With
+ * dev NULL it hashes zeroes throughout.
+ */
+static int asgn1_digest_span(asgn1_dev *dev, struct shash_desc *desc, loff_t pos, loff_t end) {
+
+    struct page *page = NULL;
+    size_t offset, len;
+    void *addr;
+    int result;
+
+    while (pos < end) {
+        offset = pos & ~PAGE_MASK;
+        len = min_t(loff_t, PAGE_SIZE - offset, end - pos);
+        if (dev != NULL) {
+            page = asgn1_get_page_rcu(dev, pos >> PAGE_SHIFT, 0);
+            if (IS_ERR(page))
+                return PTR_ERR(page);
+        }
+        if (page != NULL) {
+            result = asgn1_verify_page(dev, pos >> PAGE_SHIFT, page, false);
+            if (result < 0) {
+                put_page(page);
+                return result;
+            }
+        }
+        addr = kmap(page != NULL ? page : ZERO_PAGE(0));
+        result = crypto_shash_update(desc, addr + offset, len);
+        kunmap(page != NULL ? page : ZERO_PAGE(0));
+        if (page != NULL)
+            put_page(page);
+        if (result < 0)
+            return result;
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        pos += len;
+        cond_resched();
+    }
+    return 0;
+}
+
+/**
+ * This function writes the digests of the chunks of an ASGN1_DIGEST
+ * request from pos to end out to the caller, at most req->nr of them.
+ * A chunk that is all hole is hashed as zeroes without looking at the
+ * device, and the digest of a whole one is only computed once. Returns
+ * the number of digests written, or an error if none could be.
+ */
+static long asgn1_digest_chunks(asgn1_dev *dev, struct crypto_shash *tfm, struct asgn1_digest *req,
+                                loff_t pos, loff_t end) {
+
+    SHASH_DESC_ON_STACK(desc, tfm);
+    unsigned int size = crypto_shash_digestsize(tfm);
+    u8 digest[ASGN1_DIGEST_MAX], zero_digest[ASGN1_DIGEST_MAX];
+    u8 __user *out = u64_to_user_ptr(req->digests);
+    bool hole, have_zero = false;
+    unsigned int done = 0;
+    loff_t next;
+    long data;
+    int result = 0;
+
+    desc->tfm = tfm;
+    desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
+    while (pos < end && done < req->nr) {
+        next = (u64)(end - pos) > req->chunk ? pos + req->chunk : end;
+        data = asgn1_next_data(dev, pos >> PAGE_SHIFT);
+        hole = data < 0 || data > (next - 1) >> PAGE_SHIFT;
+        if (hole && have_zero && next - pos == req->chunk) {
+            memcpy(digest, zero_digest, size);
+        }
+        else {
+            result = crypto_shash_init(desc);
+            if (result == 0)
+                result = asgn1_digest_span(hole ? NULL : dev, desc, pos, next);
+            if (result == 0)
+                result = crypto_shash_final(desc, digest);
+            if (result == 0 && hole && next - pos == req->chunk) {
+                memcpy(zero_digest, digest, size);
+                have_zero = true;
+            }
+        }
+        if (result == 0 && copy_to_user(out + (size_t)done * size, digest, size))
+            result = -EFAULT;
+        if (result < 0)
+            break;
+        done++;
+        pos = next;
+    }
+    shash_desc_zero(desc);
+
+    return done > 0 ? done : result;
+}
+
+/**
+ * This function serves ASGN1_DIGEST, hashing each chunk of a range of the
+ * device as read would see it, without copying the data out. The range is
+ * cut at the end of the device.
+ */
+static long asgn1_digest(asgn1_dev *dev, struct file *filp, struct asgn1_digest __user *arg) {
+
+    static const char * const algs[] = {
+        [ASGN1_DIGEST_CRC32C] = "crc32c",
+        [ASGN1_DIGEST_SHA256] = "sha256",
+    };
+    struct asgn1_digest req;
+    struct crypto_shash *tfm;
+    loff_t pos, end;
+    long result;
+
+    if (!(filp->f_mode & FMODE_READ))
+        return -EBADF;
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.algo >= ARRAY_SIZE(algs) || req.nr == 0)
+        return -EINVAL;
+    if (req.offset > LLONG_MAX || req.length > LLONG_MAX - req.offset || req.chunk > LLONG_MAX)
+        return -EINVAL;
+    pos = req.offset;
+    end = min_t(loff_t, req.offset + req.length, smp_load_acquire(&dev->data_size));
+    if (pos >= end)
+        return 0;
+    if (req.chunk == 0)
+        req.chunk = end - pos;
+
+    tfm = crypto_alloc_shash(algs[req.algo], 0, 0);
+    if (IS_ERR(tfm))
+        return PTR_ERR(tfm);
+    if (WARN_ON(crypto_shash_digestsize(tfm) > ASGN1_DIGEST_MAX))
+        result = -EINVAL;
+    else
+        result = asgn1_digest_chunks(dev, tfm, &req, pos, end);
+    crypto_free_shash(tfm);
+
+    return result;
+}
+
+/**
+ * This function drops up to nr discardable pages of a device among the
+ * FREE_BATCH pages from first, returning how many it dropped. It runs in
+ * reclaim, so it waits for nothing and allocates nothing: a range a writer
+ * holds is skipped, as are pages anyone else holds a reference to, through
+ * a read, a mapping or a pipe, and shared or snapshotted pages.
+ */
+static unsigned long asgn1_discard_batch(asgn1_dev *dev, unsigned long first, unsigned long nr) {
+
+    asgn1_store *store;
+    struct radix_tree_iter iter;
+    page_node *nodes[FREE_BATCH], *curr;
+    unsigned long indices[FREE_BATCH];
+    unsigned int count = 0;
+    range_lock range;
+    void **slot;
+
+    if (asgn1_trylock_range(dev, &range, (loff_t)first << PAGE_SHIFT,
+                            (loff_t)(first + FREE_BATCH) << PAGE_SHIFT) < 0)
+        return 0;
+    store = asgn1_locked_store(dev);
+
+    rcu_read_lock();
+    radix_tree_for_each_tagged(slot, &store->page_tree, &iter, first, DISCARD_TAG) {
+        if (iter.index >= first + FREE_BATCH || count == nr)
+            break;
+        curr = radix_tree_deref_slot(slot);
+        if (curr->dup != NULL || curr->gen != store->gen)
+            continue;
+        // readers spin on a frozen page until it is out of the index
+        if (curr->page != NULL && !page_ref_freeze(curr->page, 1))
+            continue;
+        indices[count] = iter.index;
+        nodes[count++] = curr;
+    }
+    rcu_read_unlock();
+
+    asgn1_delete_nodes(dev, indices, nodes, count, true);
+    asgn1_count(dev, discarded, count);
+    asgn1_unlock_range(dev, &range);
+
+    return count;
+}
+
+/**
+ * This function counts the pages the shrinker may drop. Disks written
+ * behind are left alone, since their backing files can't be punched to
+ * match from reclaim.
+ */
+static unsigned long asgn1_shrink_count(struct shrinker *shrinker, struct shrink_control *sc) {
+
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < num_devices; i++) {
+        if (asgn1_devices[i].wb_file == NULL)
+            count += READ_ONCE(asgn1_devices[i].num_discard);
+    }
+    return count > 0 ? count : SHRINK_EMPTY;
+}
+
+/**
+ * This function drops discardable pages under memory pressure, up to the
+ * number reclaim asks for, see asgn1_discard_batch.
+ */
+static unsigned long asgn1_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc) {
+
+    struct radix_tree_iter iter;
+    unsigned long freed = 0, index;
+    asgn1_dev *dev;
+    bool found;
+    void **slot;
+    int i;
+
+    for (i = 0; i < num_devices && freed < sc->nr_to_scan; i++) {
+        dev = &asgn1_devices[i];
+        if (dev->wb_file != NULL)
+            continue;
+        index = 0;
+        while (freed < sc->nr_to_scan && READ_ONCE(dev->num_discard) > 0) {
+            found = false;
+            rcu_read_lock();
+            radix_tree_for_each_tagged(slot, asgn1_tree(dev), &iter, index, DISCARD_TAG) {
+                index = iter.index;
+                found = true;
+                break;
+            }
+            rcu_read_unlock();
+            if (!found)
+                break;
+            freed += asgn1_discard_batch(dev, index, sc->nr_to_scan - freed);
+            index += FREE_BATCH;
+        }
+    }
+    return freed > 0 ? freed : SHRINK_STOP;
+}
+
+static struct shrinker asgn1_shrinker = {
+    .count_objects = asgn1_shrink_count,
+    .scan_objects = asgn1_shrink_scan,
+    .seeks = DEFAULT_SEEKS,
+};
+
+/**
+ * This function returns the page at index of a snapshot with a reference
+ * held, NULL if it was a hole, or an error. A page the device still shares
+ * with the snapshot may be written once the range is unlocked, so it is
+ * copied into bounce, which is returned instead. The caller must hold a
+ * range lock of the device covering the page, so no writer can be
+ * preserving or writing it.
+ */
+static struct page *asgn1_snap_get_page(asgn1_snapshot *snap, unsigned long index,
+                                        struct page *bounce) {
+
+    page_node *curr;
+    struct page *page;
+    int result;
+
+    // the page as it was if it has changed since, else the store's own
+    rcu_read_lock();
+    page = radix_tree_lookup(&snap->pages, index);
+    if (page != NULL)
+        get_page(page);
+    curr = radix_tree_lookup(&snap->store->page_tree, index);
+    rcu_read_unlock();
+    if (page != NULL)
+        return page;
+    // pages filled since the snapshot was taken were holes in it
+    if (curr == NULL || curr->gen > snap->gen)
+        return NULL;
+    if (curr->page != NULL) {
+        copy_highpage(bounce, curr->page);
+        get_page(bounce);
+        return bounce;
+    }
+
+    // the store may no longer be the device's, so leave the node compressed
+    page = alloc_page(GFP_KERNEL);
+    if (page == NULL)
+        return ERR_PTR(-ENOMEM);
+    result = asgn1_unzip(curr, page);
+    if (result < 0) {
+        __free_page(page);
+        return ERR_PTR(result);
+    }
+    return page;
+}
+
+/**
+ * This function reads a snapshot. Each page is looked up, and copied if the
+ * device still shares it, under the range lock of the device, so writers
+ * only wait for it if they hit the page being read. The copy to the user
+ * is made after unlocking, since the user buffer may be a mapping of the
+ * device itself.
+ */
+static ssize_t asgn1_snap_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    asgn1_snapshot *snap = iocb->ki_filp->private_data;
+    asgn1_dev *dev = snap->dev;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t size_read = 0, offset, len, copied;
+    struct page *page, *bounce;
+    range_lock range;
+    ssize_t result = 0;
+
+    if (pos >= snap->data_size)
+        return 0;
+    count = min_t(size_t, count, snap->data_size - pos);
+    bounce = alloc_page(GFP_KERNEL);
+    if (bounce == NULL)
+        return -ENOMEM;
+
+    while (size_read < count) {
+        offset = pos & ~PAGE_MASK;
+        len = min_t(size_t, PAGE_SIZE - offset, count - size_read);
+        result = asgn1_lock_range(dev, &range, pos, pos + len, TASK_INTERRUPTIBLE);
+        if (result < 0)
+            break;
+        page = asgn1_snap_get_page(snap, pos >> PAGE_SHIFT, bounce);
+        asgn1_unlock_range(dev, &range);
+        if (IS_ERR(page)) {
+            result = PTR_ERR(page);
+            break;
+        }
+        copied = copy_page_to_iter(page != NULL ? page : ZERO_PAGE(0), offset, len, to);
+        if (page != NULL)
+            put_page(page);
+        size_read += copied;
+        pos += copied;
+        if (copied != len) {
+            result = -EFAULT;
+            break;
+        }
+    }
+    put_page(bounce);
+
+    if (size_read == 0)
+        return result;
+    iocb->ki_pos = pos;
+    return size_read;
+}
+
+static loff_t asgn1_snap_lseek(struct file *file, loff_t offset, int whence) {
+
+    asgn1_snapshot *snap = file->private_data;
+
+    return fixed_size_llseek(file, offset, whence, snap->data_size);
+}
+
+/**
+ * This function drops a snapshot, along with the copies of pages written
+ * since it was taken and its hold on the store.
+ */
+static void asgn1_drop_snapshot(asgn1_snapshot *snap) {
+
+    struct radix_tree_iter iter;
+    range_lock range;
+    void **slot;
+
+    // no writer may be preserving a page for it while it goes
+    asgn1_lock_range(snap->dev, &range, 0, LLONG_MAX, TASK_UNINTERRUPTIBLE);
+    list_del(&snap->list);
+    asgn1_unlock_range(snap->dev, &range);
+
+    radix_tree_for_each_slot(slot, &snap->pages, &iter, 0) {
+        put_page(rcu_dereference_raw(*slot));
+        radix_tree_iter_delete(&snap->pages, &iter, slot);
+        cond_resched();
+    }
+    asgn1_queue_free_store(snap->store);
+    kfree(snap);
+}
+
+static int asgn1_snap_release(struct inode *inode, struct file *file) {
+
+    asgn1_drop_snapshot(file->private_data);
+    return 0;
+}
+
+static const struct file_operations asgn1_snap_fops = {
+    .owner = THIS_MODULE,
+    .read_iter = asgn1_snap_read_iter,
+    .llseek = asgn1_snap_lseek,
+    .release = asgn1_snap_release,
+};
+
+/**
+ * This function takes a snapshot of the device, returning a read-only file
+ * descriptor for it. It costs the same whatever the size of the device:
+ * the pages are only marked shared, by starting a new generation, and are
+ * copied when next written. Pages already mapped, through any node of the
+ * device, are unmapped so that a write through a mapping faults and copies
+ * them too. A fault racing with the snapshot may still map a page as it was
+ * found before it, as one racing with a truncate may. Writes still cached
+ * by the block front end are written to the device first. Only an fd open
+ * for writing may take one, since it makes later writes copy.
+ */
+static long asgn1_take_snapshot(asgn1_dev *dev, struct file *filp) {
+
+    struct block_device *bdev;
+    asgn1_snapshot *snap;
+    asgn1_store *store;
+    range_lock range;
+    int result;
+
+    if (!(filp->f_mode & FMODE_WRITE))
+        return -EBADF;
+
+    // the block front end has its own page cache, which must reach the store
+    if (dev->disk != NULL) {
+        bdev = bdget_disk(dev->disk, 0);
+        if (bdev != NULL) {
+            result = sync_blockdev(bdev);
+            bdput(bdev);
+            if (result < 0)
+                return result;
+        }
+    }
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (snap == NULL)
+        return -ENOMEM;
+    INIT_RADIX_TREE(&snap->pages, GFP_ATOMIC);
+    spin_lock_init(&snap->lock);
+    snap->dev = dev;
+
+    // wait for writes in flight, so the snapshot has all or none of each
+    result = asgn1_lock_range(dev, &range, 0, LLONG_MAX, TASK_INTERRUPTIBLE);
+    if (result < 0) {
+        kfree(snap);
+        return result;
+    }
+    store = asgn1_locked_store(dev);
+    atomic_inc(&store->refs);
+    snap->store = store;
+    snap->gen = store->gen;
+    snap->data_size = dev->data_size;
+    list_add(&snap->list, &store->snapshots);
+    WRITE_ONCE(store->gen, store->gen + 1);
+    unmap_mapping_range(&dev->mapping, 0, 0, 0);
+    asgn1_unlock_range(dev, &range);
+
+    pr_debug("asgn1: snapshot %lu of asgn1%d taken at %zu bytes\n",
+             snap->gen, MINOR(dev->dev), snap->data_size);
+
+    result = anon_inode_getfd("[asgn1-snapshot]", &asgn1_snap_fops, snap, O_RDONLY | O_CLOEXEC);
+    if (result < 0)
+        asgn1_drop_snapshot(snap);
+    return result;
+}
+
+/**
+ * The ioctl function, see asgn1_ioctl.h for the commands.
+ */
+long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
+
+    asgn1_dev *dev = filp->private_data;
+
+    int nr = _IOC_NR(cmd);
+    int new_nprocs;
+    int result;
+    struct asgn1_stats *stats;
+    size_t size;
+
+    pr_debug("asgn1: asgn1_ioctl called\n");
+
+    // check if cmd is for this device
+    if (_IOC_TYPE(cmd) != MYIOC_TYPE) {
+        printk(KERN_WARNING "asgn1: Got invalid case cmd = %d\n", cmd);
+        return -EINVAL;
+    }
+    
+    switch(nr) {
+    case SET_NPROC_OP:
+        result = access_ok(VERIFY_READ, arg, sizeof(int));
+        if (!result) {
+            printk(KERN_WARNING "asgn1: ioctl argument is not valid!\n");
+            return -EFAULT;
+        }
+        result = get_user(new_nprocs, (int *)arg);
+        if (new_nprocs < 0) {
+            printk(KERN_WARNING "asgn1: user tried to set max_nprocs to less than 0!\n");
+            return -EINVAL;
+        }
+        atomic_set(&dev->max_nprocs, new_nprocs);
+        break;
+    case GET_STATS_OP:
+        // callers built against an older, shorter struct get its prefix
+        if (!(_IOC_DIR(cmd) & _IOC_READ))
+            return -EINVAL;
+        stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+        if (stats == NULL)
+            return -ENOMEM;
+        asgn1_sum_stats(dev, stats);
+        size = min_t(size_t, _IOC_SIZE(cmd), sizeof(*stats));
+        result = copy_to_user((void __user *)arg, stats, size);
+        kfree(stats);
+        if (result)
+            return -EFAULT;
+        break;
+    case PREALLOC_OP:
+        return asgn1_preallocate(dev, filp, (struct asgn1_prealloc __user *)arg);
+    case SET_CONTIG_OP:
+        return asgn1_set_contig(dev, filp, (int __user *)arg);
+    case SNAPSHOT_OP:
+        return asgn1_take_snapshot(dev, filp);
+    case FSYNC_OP:
+        return asgn1_sync(dev);
+    case PUNCH_HOLE_OP:
+        return asgn1_punch_hole(dev, filp, (struct asgn1_range __user *)arg);
+    case TRUNCATE_OP:
+        return asgn1_truncate(dev, filp, (__u64 __user *)arg);
+    case SET_LIMIT_OP:
+        return asgn1_set_limit(dev, (__u64 __user *)arg);
+    case DISCARDABLE_OP:
+        return asgn1_set_discardable(dev, filp, (struct asgn1_discard __user *)arg);
+    case DIGEST_OP:
+        return asgn1_digest(dev, filp, (struct asgn1_digest __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+
+    pr_debug("asgn1: asgn1_ioctl finished\n");
+    
+    return 0;
+}
+
+/**
+ * Prints the non-empty buckets of a latency histogram as "ns:count" pairs,
+ * each bucket named by its lower bound.
+ */
+static void asgn1_show_lat(struct seq_file *m, const char *name, const __u64 *hist) {
+
+    int i;
+
+    seq_printf(m, "%s_lat_ns", name);
+    for (i = 0; i < ASGN1_LAT_BUCKETS; i++) {
+        if (hist[i] != 0)
+            seq_printf(m, " %llu:%llu", 1ULL << i, hist[i]);
+    }
+    seq_putc(m, '\n');
+}
+
+/**
+ * Prints the memory the pages of a device take up and how well they
+ * compressed and deduplicated.
+ */
+static void asgn1_show_zstats(struct seq_file *m, struct asgn1_stats *stats) {
 
-typedef struct asgn1_dev_t {
-    dev_t dev;                /* the device */
-    struct cdev *cdev;
-    struct list_head mem_list; 
-    int num_pages;            /* number of memory pages this module currently holds */
-    size_t data_size;         /* total data size in this module */
-    atomic_t nprocs;          /* number of processes accessing this device */ 
-    atomic_t max_nprocs;      /* max number of processes accessing this device */
-    struct kmem_cache *cache; /* cache memory */
-    struct class *class;      /* the udev class */
-    struct device *device;    /* the udev device node */
-} asgn1_dev;
+    u64 zpages = stats->compressed_pages;
+    u64 zbytes = stats->compressed_bytes;
+    u64 saved = stats->dedup_saved;
+    u64 ratio = zbytes ? div64_u64(zpages * PAGE_SIZE * 100, zbytes) : 100;
+    u64 dedup_ratio = stats->num_pages > saved ?
+        div64_u64(stats->num_pages * 100, stats->num_pages - saved) : 100;
 
-asgn1_dev asgn1_device;
+    seq_printf(m, "memory_bytes %llu, compressed_pages %llu, compressed_bytes %llu, ratio %llu.%02llu\n",
+               (stats->num_pages - zpages - saved) * PAGE_SIZE + zbytes, zpages, zbytes,
+               ratio / 100, ratio % 100);
+    seq_printf(m, "dedup_saved %llu, dedup_ratio %llu.%02llu\n",
+               saved, dedup_ratio / 100, dedup_ratio % 100);
+}
 
-int asgn1_major = 0;     /* major number of module */  
-int asgn1_minor = 0;     /* minor number of module */
-int asgn1_dev_count = 1; /* number of devices */
+/**
+ * Prints how far behind the backing file is and how fast it is written.
+ */
+static void asgn1_show_wbstats(struct seq_file *m, struct asgn1_stats *stats) {
 
-static struct proc_dir_entry *asgn1_proc;
+    u64 mb_s = stats->flush_ns ? div64_u64(stats->flushed_bytes * 1000, stats->flush_ns) : 0;
+
+    seq_printf(m, "dirty_pages %llu, flushed_bytes %llu, flush_mb_s %llu\n",
+               stats->dirty_pages, stats->flushed_bytes, mb_s);
+}
 
 /**
- * This function frees all memory pages held by the module.
+ * Displays information about current status of the module,
+ * which helps debugging.
  */
-void free_memory_pages(void) {
+static int asgn1_proc_show(struct seq_file *m, void *v) {
 
-    int page_num = 0;
-    page_node *curr, *tmp;
+    struct asgn1_stats *stats;
+    asgn1_dev *dev;
+    int i;
 
-    printk(KERN_INFO "asgn1: free_memory_pages called\n");
+    stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+    if (stats == NULL)
+        return -ENOMEM;
 
-    // loop through the list, while freeing all the pages
-    list_for_each_entry_safe(curr, tmp, &asgn1_device.mem_list, list) {
-        if (curr != NULL) {
-            printk(KERN_INFO "asgn1: Freeing memory page %d\n", page_num++);
-            __free_page(curr->page);
-            list_del(&curr->list);
-            kfree(curr);
-        }
+    for (i = 0; i < num_devices; i++) {
+        dev = &asgn1_devices[i];
+        asgn1_sum_stats(dev, stats);
+        seq_printf(m, "%s%d: nprocs %d, max_nprocs %d\nnum_pages %llu, data_size %llu, contig %d\n",
+                   MYDEV_NAME, i,
+                   atomic_read(&dev->nprocs),
+                   atomic_read(&dev->max_nprocs),
+                   stats->num_pages,
+                   stats->data_size,
+                   READ_ONCE(dev->contig));
+        seq_printf(m, "read_ops %llu, read_bytes %llu\nwrite_ops %llu, write_bytes %llu\n",
+                   stats->read_ops, stats->read_bytes,
+                   stats->write_ops, stats->write_bytes);
+        seq_printf(m, "pages_alloc %llu, pages_freed %llu\nmmap_faults %llu, open_busy %llu, nowait_again %llu\n",
+                   stats->pages_alloc, stats->pages_freed,
+                   stats->mmap_faults, stats->open_busy, stats->nowait_again);
+        seq_printf(m, "limit_bytes %llu, used_bytes %llu, discardable_pages %llu, discarded_pages %llu\n",
+                   stats->limit_bytes, stats->num_pages * PAGE_SIZE,
+                   stats->discardable_pages, stats->discarded_pages);
+        if (checksum)
+            seq_printf(m, "crc_errors %llu, scrub_passes %llu, scrubbed_pages %llu, scrub_offset %llu\n",
+                       stats->crc_errors, stats->scrub_passes, stats->scrubbed_pages, stats->scrub_offset);
+        asgn1_show_zstats(m, stats);
+        asgn1_show_wbstats(m, stats);
+        asgn1_show_lat(m, "read", stats->read_lat);
+        asgn1_show_lat(m, "write", stats->write_lat);
+        asgn1_show_lat(m, "fault", stats->fault_lat);
     }
+    kfree(stats);
 
-    // resey data_size and num_pages
-    asgn1_device.data_size = 0;
-    asgn1_device.num_pages = 0;
-    
-    printk(KERN_INFO "asgn1: free_memory_pages finished\n");
+    return 0;
+}
+
+static int asgn1_proc_open(struct inode *inode, struct file *file) {
+
+    return single_open(file, asgn1_proc_show, NULL);
 }
 
+static const struct file_operations asgn1_proc_fops = {
+    .owner = THIS_MODULE,
+    .open = asgn1_proc_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
 /**
- * This function opens the virtual disk, if it is opened in the write-only
- * mode, all memory pages will be freed.
+ * This function maps a page of the virtual disk into a process on first
+ * touch. Holes are filled, and writes through a shared mapping may grow the
+ * disk, but anything else past the end of the data has nothing to map.
  */
-int asgn1_open(struct inode *inode, struct file *filp) {
+static vm_fault_t asgn1_vma_fault(struct vm_fault *vmf) {
 
-    int num_procs = atomic_read(&asgn1_device.nprocs);
-    int max_num_procs = atomic_read(&asgn1_device.max_nprocs);
+    struct vm_area_struct *vma = vmf->vma;
+    asgn1_dev *dev = vma->vm_private_data;
+    unsigned long data_pages = PAGE_ALIGN(smp_load_acquire(&dev->data_size)) >> PAGE_SHIFT;
+    page_node *curr;
+    struct page *page;
+    range_lock range;
+    u64 start = ktime_get_ns();
 
-    printk(KERN_INFO "asgn1: asgn1_open called\n");
-    
-    if (num_procs >= max_num_procs) {
-        printk(KERN_WARNING "asgn1: Device already in use!\n");
-        return -EBUSY;
+    trace_asgn1_fault(MINOR(dev->dev), vmf->pgoff, vmf->address, vmf->flags);
+    asgn1_count(dev, mmap_faults, 1);
+
+    if (vmf->pgoff >= data_pages &&
+        (!(vmf->flags & FAULT_FLAG_WRITE) || !(vma->vm_flags & VM_SHARED)))
+        return VM_FAULT_SIGBUS;
+
+    // pages already there are found without the lock, like asgn1_read_iter
+    page = asgn1_get_page_rcu(dev, vmf->pgoff, GET_PRIVATE);
+    if (IS_ERR(page))
+        return PTR_ERR(page) == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+    if (page != NULL) {
+        vmf->page = page;
+        asgn1_count_lat(dev, fault_lat, start);
+        return 0;
     }
-    
-    atomic_inc(&asgn1_device.nprocs);
-    printk(KERN_INFO "asgn1: Process count incremented to %d\n", atomic_read(&asgn1_device.nprocs));
 
-    // If opened in write-only
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        printk(KERN_INFO "asgn1: Opened in write-only\n");
-        free_memory_pages();
+    asgn1_lock_range(dev, &range, (loff_t)vmf->pgoff << PAGE_SHIFT,
+                     (loff_t)(vmf->pgoff + 1) << PAGE_SHIFT, TASK_UNINTERRUPTIBLE);
+    // the disk may have been truncated since data_pages was read
+    if ((vmf->pgoff << PAGE_SHIFT) >= smp_load_acquire(&dev->data_size) &&
+        (!(vmf->flags & FAULT_FLAG_WRITE) || !(vma->vm_flags & VM_SHARED))) {
+        asgn1_unlock_range(dev, &range);
+        return VM_FAULT_SIGBUS;
     }
-    
-    printk(KERN_INFO "asgn1: asgn1_open finished\n");
+    asgn1_fill_holes(dev, vmf->pgoff, vmf->pgoff, NUMA_NO_NODE);
+    curr = asgn1_get_node(dev, vmf->pgoff);
+    if (IS_ERR(curr)) {
+        asgn1_unlock_range(dev, &range);
+        // like a write past the limits of tmpfs
+        return PTR_ERR(curr) == -ENOSPC ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+    }
+    asgn1_grow(dev, (vmf->pgoff + 1) << PAGE_SHIFT);
+    get_page(curr->page);
+    vmf->page = curr->page;
+    asgn1_unlock_range(dev, &range);
+    asgn1_count_lat(dev, fault_lat, start);
 
     return 0;
 }
 
 /**
- * This function releases the virtual disk, but nothing needs to be done
- * in this case. 
+ * This function tags a page dirty on the first write to it through a
+ * mapping since it was last written behind, see asgn1_flush_batch. The
+ * page stays locked until the core has made it writable. Pages
+ * checksummed stop being checked until sealed again, see asgn1_reset_crc.
+ * A page no longer in the device, since it was emptied or the page was
+ * punched out, is faulted in again instead.
  */
-int asgn1_release (struct inode *inode, struct file *filp) {
+static vm_fault_t asgn1_vma_mkwrite(struct vm_fault *vmf) {
 
-    printk(KERN_INFO "asgn1: asgn1_release called\n");
-    
-    atomic_dec(&asgn1_device.nprocs);
-    printk(KERN_INFO "asgn1: Process count decremented to %d\n", atomic_read(&asgn1_device.nprocs));
+    asgn1_dev *dev = vmf->vma->vm_private_data;
+    unsigned long index = vmf->pgoff;
+    page_node *curr;
+    bool gone;
 
-    printk(KERN_INFO "asgn1: asgn1_release finished\n");
+    lock_page(vmf->page);
+    rcu_read_lock();
+    curr = radix_tree_lookup(asgn1_tree(dev), index);
+    gone = curr == NULL || READ_ONCE(curr->page) != vmf->page;
+    rcu_read_unlock();
+    if (gone) {
+        unlock_page(vmf->page);
+        return VM_FAULT_NOPAGE;
+    }
+    if (checksum)
+        asgn1_crc_stale(dev, index);
+    asgn1_mark_dirty(dev, index);
 
-    return 0;
+    return VM_FAULT_LOCKED;
 }
 
+static const struct vm_operations_struct asgn1_vm_ops = {
+    .fault = asgn1_vma_fault,
+};
+
 /**
- * This function reads contents of the virtual disk and writes to the user 
+ * Mappings of a disk written behind or checksummed have writes tracked, see
+ * asgn1_vma_mkwrite.
  */
-ssize_t asgn1_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+static const struct vm_operations_struct asgn1_wb_vm_ops = {
+    .fault = asgn1_vma_fault,
+    .page_mkwrite = asgn1_vma_mkwrite,
+};
 
-    size_t size_read = 0;                     /* size read from virtual disk in this function */
-    size_t begin_offset = *f_pos % PAGE_SIZE; /* the offset from the beginning of a page to start reading */
-    int begin_page_no = *f_pos / PAGE_SIZE;   /* the first page which contains the requested data */
-    int curr_page_no = -1;                    /* the current page number */
-    size_t curr_size_read;                    /* size read from the virtual disk in this round */
-    size_t size_to_be_read;                   /* size to be read in the current round in while loop */
-    size_t size_to_read;                      /* size left to read from kernel space */
-    size_t size_from_pages;                   /* maximum size to read from all pages */
-    page_node *curr;                          /* the current node in the list */
+/**
+ * This function sets up a mapping of the virtual disk. Nothing is mapped
+ * until it is touched, see asgn1_vma_fault.
+ */
+static int asgn1_mmap (struct file *filp, struct vm_area_struct *vma) {
 
-    printk(KERN_INFO "asgn1: asgn1_read called\n");
-    printk(KERN_INFO "asgn1: Number of pages %d\n", asgn1_device.num_pages);
+    asgn1_dev *dev = filp->private_data;
 
-    if (*f_pos > asgn1_device.data_size) {
-        printk(KERN_WARNING "asgn1: f_pos (%d) > data_size (%d)\n", (int)*f_pos, (int)asgn1_device.data_size);
-        return 0;
-    }
+    pr_debug("asgn1: asgn1_mmap called\n");
 
-    size_from_pages = min(count, asgn1_device.data_size - (size_t)*f_pos);
-
-    // loop through the list, reading the contents of each page
-    list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-        // if we have reached the starting page to read from
-        if (++curr_page_no == begin_page_no) {
-            size_to_read = min((int)(PAGE_SIZE - begin_offset), (int)(size_from_pages - size_read));
-            printk(KERN_INFO "asgn1: Reading from page %d with size %d\n", curr_page_no, size_to_read);
-            size_to_be_read = copy_to_user(buf + size_read, page_address(curr->page) + begin_offset, size_to_read);
-            printk(KERN_INFO "asgn1: Size left to read = %d\n", size_to_be_read);
-            curr_size_read = size_to_read - size_to_be_read;
-            size_to_read = size_to_be_read;
-            size_read += curr_size_read;
-            printk(KERN_INFO "asgn1: size_from_pages %d, size_read %d\n", size_from_pages, size_read);
-            // if still more to read
-            if (size_from_pages != size_read) {
-                begin_page_no++;  // go to next page
-                begin_offset = 0; // offset at start of page
-                printk(KERN_INFO "asgn1: Read from the next page %d\n", begin_page_no);
-            }
-            // nothing else to read
-            else {
-                printk(KERN_INFO "asgn1: Nothing left to read\n");
-                break;
-            }
-        }
-    }
+    if (dev->wb_file != NULL || checksum)
+        vma->vm_ops = &asgn1_wb_vm_ops;
+    else
+        vma->vm_ops = &asgn1_vm_ops;
+    vma->vm_private_data = filp->private_data;
+    vma->vm_flags |= VM_DONTDUMP;
 
-    *f_pos += size_read;
-    
-    printk(KERN_INFO "asgn1: size_read = %d\n", size_read);
-    
-    printk(KERN_INFO "asgn1: asgn1_read finished\n");
+    pr_debug("asgn1: Mapping pages from %ld to %ld on demand\n", vma->vm_start, vma->vm_end);
+
+    pr_debug("asgn1: asgn1_mmap finished\n");
     
-    return size_read;
+    return 0;
 }
 
-static loff_t asgn1_lseek (struct file *file, loff_t offset, int cmd) {
-    
-    loff_t testpos;
-    size_t buffer_size = asgn1_device.num_pages * PAGE_SIZE;
+/**
+ * This function waits for the disk to be written behind, see asgn1_sync.
+ */
+static int asgn1_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
 
-    printk(KERN_INFO "asgn1: asgn1_leek called\n");
-    
-    switch(cmd) {
-    case SEEK_SET:
-        testpos = offset;
-        break;
-    case SEEK_CUR:
-        testpos = file->f_pos + offset;
+    return asgn1_sync(filp->private_data);
+}
+
+struct file_operations asgn1_fops = {
+    .owner = THIS_MODULE,
+    .fsync = asgn1_fsync,
+    .read_iter = asgn1_read_iter,
+    .write_iter = asgn1_write_iter,
+    .splice_read = asgn1_splice_read,
+    .splice_write = iter_file_splice_write,
+    .unlocked_ioctl = asgn1_ioctl,
+    .open = asgn1_open,
+    .mmap = asgn1_mmap,
+    .release = asgn1_release,
+    .llseek = asgn1_lseek
+};
+
+/**
+ * This function serves a block request straight from the page store, one
+ * segment at a time, through the same paths as read and write. The block
+ * device reads the whole disk, holes as zeroes, whatever data_size is. On a
+ * disk written behind, flushes and FUA writes wait for the backing file,
+ * see asgn1_sync.
+ */
+static blk_status_t asgn1_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+
+    struct request *rq = bd->rq;
+    asgn1_dev *dev = hctx->queue->queuedata;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << 9;
+    bool write = op_is_write(req_op(rq));
+    blk_status_t status = BLK_STS_OK;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    struct iov_iter i;
+    ssize_t result;
+
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq)) {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        rq_for_each_segment(bvec, rq, iter) {
+            iov_iter_bvec(&i, ITER_BVEC | (write ? WRITE : READ), &bvec, 1, bvec.bv_len);
+            if (write)
+                result = asgn1_write_pages(dev, pos, &i, TASK_UNINTERRUPTIBLE, false);
+            else
+                result = asgn1_read_pages(dev, pos, bvec.bv_len, &i, false);
+            if (result != bvec.bv_len) {
+                status = result == -ENOMEM ? BLK_STS_RESOURCE :
+                         result == -ENOSPC ? BLK_STS_NOSPC : BLK_STS_IOERR;
+                goto out;
+            }
+            pos += bvec.bv_len;
+        }
+        if (write) {
+            asgn1_count(dev, write_ops, 1);
+            asgn1_count(dev, write_bytes, blk_rq_bytes(rq));
+            if ((rq->cmd_flags & REQ_FUA) && dev->wb_file != NULL && asgn1_sync(dev) < 0)
+                status = BLK_STS_IOERR;
+        } else {
+            asgn1_count(dev, read_ops, 1);
+            asgn1_count(dev, read_bytes, blk_rq_bytes(rq));
+        }
         break;
-    case SEEK_END:
-        testpos = buffer_size + offset;
+    case REQ_OP_FLUSH:
+        // without a backing file the pages are the storage
+        if (dev->wb_file != NULL && asgn1_sync(dev) < 0)
+            status = BLK_STS_IOERR;
         break;
     default:
-        return -EINVAL;
+        status = BLK_STS_NOTSUPP;
     }
-    
-    if (testpos > buffer_size)
-        testpos = buffer_size;
-    else if (testpos < 0)
-        testpos = 0;
 
-    file->f_pos = testpos;
-    
-    printk(KERN_INFO "asgn1: Seeking to pos=%ld\n", (long)testpos);
-
-    printk(KERN_INFO "asgn1: asgn1_leek finished\n");
-    
-    return testpos;
+out:
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
 }
 
+static const struct blk_mq_ops asgn1_mq_ops = {
+    .queue_rq = asgn1_queue_rq,
+};
+
+static const struct block_device_operations asgn1_bdops = {
+    .owner = THIS_MODULE,
+};
+
 /**
- * This function writes from the user buffer to the virtual disk of this
- * module
+ * Create the block device of one device, with a hardware queue per CPU.
+ * Requests may sleep on range locks, page allocation and write-behind,
+ * hence blocking.
  */
-ssize_t asgn1_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+static int __init asgn1_setup_disk(asgn1_dev *dev, int index) {
 
-    size_t orig_f_pos = *f_pos;               /* the original file position */
-    size_t size_written = 0;                  /* size written to virtual disk in this function */
-    size_t begin_offset = *f_pos % PAGE_SIZE; /* the offset from the beginning of a page to start writing */
-    int begin_page_no = *f_pos / PAGE_SIZE;   /* the first page this function should start writing to */
-    int curr_page_no = -1;                    /* the current page number */
-    size_t curr_size_written;                 /* size written to virtual disk in this round */
-    size_t size_to_be_written;                /* size to be read in the current round in while loop */
-    size_t size_to_write = count;             /* size left to copy over from user space */
-    page_node *curr;                          /* the current node in the list */
+    struct request_queue *q;
+    int result;
 
-    printk(KERN_INFO "asgn1: asgn1_write called\n");
-    printk(KERN_INFO "asgn1: *f_pos + count = %d\n", (int)(*f_pos + count));
-      
-    // add pages if necessary
-    while (asgn1_device.num_pages * PAGE_SIZE < *f_pos + count) {
-        curr = kmalloc(sizeof(page_node), GFP_KERNEL);
-        if (curr != NULL) {
-            curr->page = alloc_page(GFP_KERNEL);
-            if (curr->page == NULL) {
-                printk(KERN_WARNING "asgn1: Page allocation failed!\n");
-                return size_written;
-            }
-            list_add_tail(&curr->list, &asgn1_device.mem_list);
-            asgn1_device.num_pages++;
-            printk(KERN_INFO "asgn1: Added pages to list: %d\n", asgn1_device.num_pages);
-        }
-        else {
-            printk(KERN_WARNING "asgn1: Couldn't add pages to list!\n");
-            return size_written;
-        }
-    }
-
-    // loop through the list, writing to each page
-    list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-        // if we have reached the starting page to write
-        if (++curr_page_no == begin_page_no) {
-            size_to_write = min((int)(PAGE_SIZE - begin_offset), (int)(count - size_written));
-            printk(KERN_INFO "asgn1: Writing to page %d with size %d\n", curr_page_no, size_to_write);
-            size_to_be_written = copy_from_user(page_address(curr->page) + begin_offset, buf + size_written, size_to_write);
-            printk(KERN_INFO "asgn1: Size left to write = %d\n", size_to_be_written);
-            curr_size_written = size_to_write - size_to_be_written;
-            size_to_write = size_to_be_written;
-            size_written += curr_size_written;
-            printk(KERN_INFO "asgn1: count %d, size_written %d\n", count, size_written);
-            // if still more to write
-            if (size_written != count) {
-                begin_page_no++;  // go to next page
-                begin_offset = 0; // offset at start of page
-                printk(KERN_INFO "asgn1: Write to the next page %d\n", begin_page_no);
-            }
-            // nothing else to write
-            else {
-                printk(KERN_INFO "asgn1: Nothing left to write\n");
-                break;
-            }
-        }
+    dev->tag_set.ops = &asgn1_mq_ops;
+    dev->tag_set.nr_hw_queues = nr_cpu_ids;
+    dev->tag_set.queue_depth = 128;
+    dev->tag_set.numa_node = NUMA_NO_NODE;
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+    result = blk_mq_alloc_tag_set(&dev->tag_set);
+    if (result < 0)
+        return result;
+
+    q = blk_mq_init_queue(&dev->tag_set);
+    if (IS_ERR(q)) {
+        result = PTR_ERR(q);
+        goto fail_queue;
     }
+    q->queuedata = dev;
+    blk_queue_logical_block_size(q, 512);
+    blk_queue_physical_block_size(q, PAGE_SIZE);
+    blk_queue_flag_set(QUEUE_FLAG_NONROT, q);
+    blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, q);
+    // writes are only durable once written behind
+    if (dev->wb_file != NULL)
+        blk_queue_write_cache(q, true, true);
 
-    *f_pos += size_written;
-    
-    printk(KERN_INFO "asgn1: size_written = %d\n", size_written);
-    
-    asgn1_device.data_size = max(asgn1_device.data_size, orig_f_pos + size_written);
-    
-    printk(KERN_INFO "asgn1: asgn1_write finished\n");
-    
-    return size_written;
+    dev->disk = alloc_disk(1);
+    if (dev->disk == NULL) {
+        result = -ENOMEM;
+        goto fail_disk;
+    }
+    dev->disk->major = asgn1_blk_major;
+    dev->disk->first_minor = index;
+    dev->disk->fops = &asgn1_bdops;
+    dev->disk->queue = q;
+    dev->disk->private_data = dev;
+    snprintf(dev->disk->disk_name, DISK_NAME_LEN, "%sb%d", MYDEV_NAME, index);
+    set_capacity(dev->disk, (sector_t)disk_mib << (20 - 9));
+    add_disk(dev->disk);
+
+    return 0;
+
+fail_disk:
+    blk_cleanup_queue(q);
+fail_queue:
+    blk_mq_free_tag_set(&dev->tag_set);
+
+    return result;
 }
 
-#define SET_NPROC_OP 1
-#define TEM_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int) 
+/**
+ * Remove the block device of one device
+ */
+static void asgn1_teardown_disk(asgn1_dev *dev) {
+
+    struct request_queue *q = dev->disk->queue;
+
+    del_gendisk(dev->disk);
+    blk_cleanup_queue(q);
+    blk_mq_free_tag_set(&dev->tag_set);
+    put_disk(dev->disk);
+    dev->disk = NULL;
+}
 
 /**
- * The ioctl function, which nothing needs to be done in this case.
+ * Initialise one device and create its udev node
  */
-long asgn1_ioctl (struct file *filp, unsigned cmd, unsigned long arg) {
+static int __init asgn1_setup_device(asgn1_dev *dev, int index) {
 
-    int nr = _IOC_NR(cmd);
-    int new_nprocs;
     int result;
 
-    printk(KERN_INFO "asgn1: asgn1_ioctl called\n");
-
-    // check if cmd is for this device
-    if (_IOC_TYPE(cmd) != MYIOC_TYPE) {
-        printk(KERN_WARNING "asgn1: Got invalid case cmd = %d\n", cmd);
-        return -EINVAL;
+    dev->dev = MKDEV(asgn1_major, asgn1_minor + index);
+    atomic_set(&dev->nprocs, 0);
+    atomic_set(&dev->max_nprocs, max_nprocs);
+    dev->contig = contig;
+    address_space_init_once(&dev->mapping);
+    spin_lock_init(&dev->lock);
+    INIT_LIST_HEAD(&dev->ranges);
+    spin_lock_init(&dev->range_lock);
+    init_waitqueue_head(&dev->range_wait);
+    INIT_DELAYED_WORK(&dev->compress_work, asgn1_compress_work);
+    INIT_DELAYED_WORK(&dev->scrub_work, asgn1_scrub_work);
+    mutex_init(&dev->wb_mutex);
+    INIT_DELAYED_WORK(&dev->flush_work, asgn1_flush_work);
+    RCU_INIT_POINTER(dev->store, asgn1_alloc_store(dev));
+    if (rcu_access_pointer(dev->store) == NULL)
+        return -ENOMEM;
+    dev->stats = alloc_percpu(asgn1_cpu_stats);
+    if (dev->stats == NULL) {
+        result = -ENOMEM;
+        goto fail_stats;
     }
-    
-    switch(nr) {
-    case SET_NPROC_OP:
-        result = access_ok(VERIFY_READ, arg, sizeof(int));
-        if (!result) {
-            printk(KERN_WARNING "asgn1: ioctl argument is not valid!\n");
-            return -EFAULT;
+
+    if (backing != NULL) {
+        // the file is cut back on the first flush unless the disk came from it
+        dev->wb_truncated = asgn1_restore_device(dev, index) < 0;
+        if (flush_secs > 0) {
+            dev->wb_file = asgn1_open_backing(index, O_RDWR | O_CREAT);
+            if (IS_ERR(dev->wb_file)) {
+                printk(KERN_WARNING "asgn1: %s%d: can't write behind to backing file (%ld)\n",
+                       MYDEV_NAME, index, PTR_ERR(dev->wb_file));
+                dev->wb_file = NULL;
+            }
         }
-        result = get_user(new_nprocs, (int *)arg);
-        if (new_nprocs < 0) {
-            printk(KERN_WARNING "asgn1: user tried to set max_nprocs to less than 0!\n");
-            return -EINVAL;
+    }
+    // only now, so a disk saved under a higher limit is restored whole
+    dev->max_pages = limit_mib << (20 - PAGE_SHIFT);
+
+    cdev_init(&dev->cdev, &asgn1_fops);
+    dev->cdev.owner = THIS_MODULE;
+    result = cdev_add(&dev->cdev, dev->dev, 1);
+    if (result < 0)
+        goto fail_cdev;
+
+    dev->device = device_create(asgn1_class, NULL, dev->dev, dev, "%s%d", MYDEV_NAME, index);
+    if (IS_ERR(dev->device)) {
+        printk(KERN_WARNING "asgn1: %s%d: can't create udev device\n", MYDEV_NAME, index);
+        result = PTR_ERR(dev->device);
+        goto fail_device;
+    }
+
+    if (disk_mib > 0) {
+        result = asgn1_setup_disk(dev, index);
+        if (result < 0) {
+            printk(KERN_WARNING "asgn1: %s%d: can't create block device\n", MYDEV_NAME, index);
+            goto fail_disk;
         }
-        atomic_set(&asgn1_device.max_nprocs, new_nprocs);
-        break;
-    default:
-        return -ENOTTY;
     }
 
-    printk(KERN_INFO "asgn1: asgn1_ioctl finished\n");
-    
+    if (compress_secs > 0)
+        queue_delayed_work(system_long_wq, &dev->compress_work, compress_secs * HZ);
+    if (checksum && scrub_secs > 0)
+        queue_delayed_work(system_long_wq, &dev->scrub_work, scrub_secs * HZ);
+    if (dev->wb_file != NULL)
+        queue_delayed_work(system_long_wq, &dev->flush_work, flush_secs * HZ);
+
     return 0;
+
+fail_disk:
+    device_destroy(asgn1_class, dev->dev);
+fail_device:
+    cdev_del(&dev->cdev);
+fail_cdev:
+    if (dev->wb_file != NULL)
+        filp_close(dev->wb_file, NULL);
+    // drop whatever was restored
+    free_memory_pages(dev);
+    free_percpu(dev->stats);
+fail_stats:
+    asgn1_release_store(rcu_access_pointer(dev->store));
+
+    return result;
 }
 
 /**
- * Displays information about current status of the module,
- * which helps debugging.
+ * Remove one device and queue its pages to be freed, see asgn1_drain_frees
  */
-int asgn1_read_procmem(char *buf, char **start, off_t offset, int count, int *eof, void *data) {
+static void asgn1_teardown_device(asgn1_dev *dev) {
 
-    *eof = 1;
-    return snprintf(buf, count, "nprocs %d, max_nprocs %d\nnum_pages %d, data_size %d\n",
-                      atomic_read(&asgn1_device.nprocs),
-                      atomic_read(&asgn1_device.max_nprocs),
-                      asgn1_device.num_pages,
-                      asgn1_device.data_size);
+    if (dev->disk != NULL)
+        asgn1_teardown_disk(dev);
+    cancel_delayed_work_sync(&dev->compress_work);
+    cancel_delayed_work_sync(&dev->scrub_work);
+    cancel_delayed_work_sync(&dev->flush_work);
+    if (dev->wb_file != NULL)
+        filp_close(dev->wb_file, NULL);
+    device_destroy(asgn1_class, dev->dev);
+    cdev_del(&dev->cdev);
+    asgn1_queue_free_store(rcu_dereference_protected(dev->store, true));
+    free_percpu(dev->stats);
 }
 
-static int asgn1_mmap (struct file *filp, struct vm_area_struct *vma) {
+/**
+ * Wait for every queued store to be freed and destroy asgn1_free_wq. Stores
+ * are only queued after a grace period, hence the rcu_barrier first. The
+ * devices are freed in parallel, one worker each.
+ */
+static void asgn1_drain_frees(void) {
 
-    unsigned long pfn;
-    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
-    unsigned long len = vma->vm_end - vma->vm_start;
-    unsigned long ramdisk_size = asgn1_device.num_pages * PAGE_SIZE;
-    page_node *curr;
-    unsigned long index = 0;
+    rcu_barrier();
+    destroy_workqueue(asgn1_free_wq);
+}
 
-    printk(KERN_INFO "asgn1: asgn1_mmap called\n");
-    
-    if (len > ramdisk_size || offset > asgn1_device.num_pages) {
-        printk(KERN_WARNING "asgn1: offset or len are invalid!\n");
-        return -EINVAL;
+/**
+ * Free the compressors, if any
+ */
+static void asgn1_free_tfms(void) {
+
+    int cpu;
+
+    if (asgn1_tfms == NULL)
+        return;
+    for_each_possible_cpu(cpu) {
+        if (!IS_ERR_OR_NULL(*per_cpu_ptr(asgn1_tfms, cpu)))
+            crypto_free_comp(*per_cpu_ptr(asgn1_tfms, cpu));
     }
+    free_percpu(asgn1_tfms);
+}
 
-    // loop through the list, remapping the requested pages
-    list_for_each_entry(curr, &asgn1_device.mem_list, list) {
-        if (index >= offset && vma->vm_start+(index*PAGE_SIZE) < vma->vm_end) {
-            printk(KERN_INFO "asgn1: Remaping pages from %ld to %ld\n", vma->vm_start, vma->vm_end);
-            pfn = page_to_pfn(curr->page);
-            remap_pfn_range(vma, vma->vm_start+(index*PAGE_SIZE), pfn, PAGE_SIZE, vma->vm_page_prot);
-            
+/**
+ * Allocate a compressor per CPU when compression is enabled
+ */
+static int __init asgn1_alloc_tfms(void) {
+
+    struct crypto_comp *tfm;
+    int cpu;
+
+    if (compress_secs <= 0)
+        return 0;
+
+    asgn1_tfms = alloc_percpu(struct crypto_comp *);
+    if (asgn1_tfms == NULL)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        tfm = crypto_alloc_comp(compress_alg, 0, 0);
+        *per_cpu_ptr(asgn1_tfms, cpu) = tfm;
+        if (IS_ERR(tfm)) {
+            printk(KERN_WARNING "asgn1: Couldn't load compressor %s\n", compress_alg);
+            asgn1_free_tfms();
+            asgn1_tfms = NULL;
+            return PTR_ERR(tfm);
         }
-        index++;
     }
+    printk(KERN_WARNING "asgn1: compressing pages idle for %ds with %s\n", compress_secs, compress_alg);
 
-    printk(KERN_INFO "asgn1: asgn1_mmap finished\n");
-    
     return 0;
 }
 
-struct file_operations asgn1_fops = {
-    .owner = THIS_MODULE,
-    .read = asgn1_read,
-    .write = asgn1_write,
-    .unlocked_ioctl = asgn1_ioctl,
-    .open = asgn1_open,
-    .mmap = asgn1_mmap,
-    .release = asgn1_release,
-    .llseek = asgn1_lseek
-};
-
 /**
- * Initialise the module and create the master device
+ * Initialise the module and create the devices
  */
 int __init asgn1_init_module(void) {
 
-    int result; 
+    dev_t devno;
+    int result;
+    int i;
+
+    if (num_devices < 1) {
+        printk(KERN_WARNING "asgn1: num_devices must be at least 1\n");
+        return -EINVAL;
+    }
+
+    asgn1_node_cache = kmem_cache_create(MYDEV_NAME "_page_node", sizeof(page_node), 0,
+                                         SLAB_HWCACHE_ALIGN | SLAB_TYPESAFE_BY_RCU, NULL);
+    if (asgn1_node_cache == NULL)
+        return -ENOMEM;
+    asgn1_zero_crc = asgn1_page_crc(ZERO_PAGE(0));
 
-    atomic_set(&asgn1_device.nprocs, 0);
-    atomic_set(&asgn1_device.max_nprocs, 1);
-    result = alloc_chrdev_region(&asgn1_device.dev, asgn1_minor, asgn1_dev_count, MYDEV_NAME);
+    result = asgn1_alloc_tfms();
     if (result < 0)
-        goto fail_device;
-    asgn1_device.cdev = cdev_alloc();
-    asgn1_device.cdev->ops = &asgn1_fops;
-    asgn1_device.cdev->owner = asgn1_fops.owner;
-    result = cdev_add(asgn1_device.cdev, asgn1_device.dev, asgn1_dev_count);
+        goto fail_tfms;
+
+    asgn1_free_wq = alloc_workqueue(MYDEV_NAME "_free", WQ_UNBOUND, 0);
+    if (asgn1_free_wq == NULL) {
+        result = -ENOMEM;
+        goto fail_wq;
+    }
+
+    asgn1_devices = kcalloc(num_devices, sizeof(asgn1_dev), GFP_KERNEL);
+    if (asgn1_devices == NULL) {
+        result = -ENOMEM;
+        goto fail_devices;
+    }
+
+    result = alloc_chrdev_region(&devno, asgn1_minor, num_devices, MYDEV_NAME);
     if (result < 0)
-        goto fail_device;
-    INIT_LIST_HEAD(&asgn1_device.mem_list);
-    asgn1_proc = create_proc_entry(MYDEV_NAME, 777, NULL);
-    if (!asgn1_proc) {
-        printk(KERN_INFO "asgn1: Failed to create proc entry %s\n", MYDEV_NAME);
-        return -ENOMEM;
+        goto fail_region;
+    asgn1_major = MAJOR(devno);
+
+    asgn1_class = class_create(THIS_MODULE, MYDEV_NAME);
+    if (IS_ERR(asgn1_class)) {
+        result = PTR_ERR(asgn1_class);
+        goto fail_class;
+    }
+
+    if (disk_mib > 0) {
+        asgn1_blk_major = register_blkdev(0, MYDEV_NAME);
+        if (asgn1_blk_major < 0) {
+            result = asgn1_blk_major;
+            goto fail_blkdev;
+        }
+    }
+
+    for (i = 0; i < num_devices; i++) {
+        result = asgn1_setup_device(&asgn1_devices[i], i);
+        if (result < 0)
+            goto fail_device;
     }
-    asgn1_proc->read_proc = asgn1_read_procmem;
+    printk(KERN_WARNING "asgn1: set up udev entries\n");
 
-    asgn1_device.class = class_create(THIS_MODULE, MYDEV_NAME);
-    if (IS_ERR(asgn1_device.class)) {
+    if (shrink) {
+        result = register_shrinker(&asgn1_shrinker);
+        if (result < 0)
+            goto fail_device;
     }
 
-    asgn1_device.device = device_create(asgn1_device.class, NULL, 
-                                        asgn1_device.dev, "%s", MYDEV_NAME);
-    if (IS_ERR(asgn1_device.device)) {
-        printk(KERN_WARNING "asgn1: %s: can't create udev device\n", MYDEV_NAME);
+    asgn1_proc = proc_create(MYDEV_NAME, 0444, NULL, &asgn1_proc_fops);
+    if (!asgn1_proc) {
+        printk(KERN_WARNING "asgn1: Failed to create proc entry %s\n", MYDEV_NAME);
         result = -ENOMEM;
-        goto fail_device;
+        goto fail_proc;
     }
 
-    printk(KERN_WARNING "asgn1: set up udev entry\n");
     printk(KERN_WARNING "asgn1: Hello world from %s\n", MYDEV_NAME);
     return 0;
 
+fail_proc:
+    if (shrink)
+        unregister_shrinker(&asgn1_shrinker);
 fail_device:
-    class_destroy(asgn1_device.class);
-
-
-    free_memory_pages();
-    if (asgn1_device.dev)
-        unregister_chrdev_region(asgn1_device.dev, 1);
-    if (asgn1_device.class)
-        class_destroy(asgn1_device.class);
-    if (asgn1_proc)
-        remove_proc_entry(MYDEV_NAME, NULL);
-    if (asgn1_device.cdev)
-        cdev_del(asgn1_device.cdev);
+    while (--i >= 0)
+        asgn1_teardown_device(&asgn1_devices[i]);
+    if (disk_mib > 0)
+        unregister_blkdev(asgn1_blk_major, MYDEV_NAME);
+fail_blkdev:
+    class_destroy(asgn1_class);
+fail_class:
+    unregister_chrdev_region(devno, num_devices);
+fail_region:
+    kfree(asgn1_devices);
+fail_devices:
+    asgn1_drain_frees();
+fail_wq:
+    asgn1_free_tfms();
+fail_tfms:
+    kmem_cache_destroy(asgn1_node_cache);
     
     return result;
 }
@@ -474,15 +4249,36 @@ fail_device:
  */
 void __exit asgn1_exit_module(void) {
     
-    device_destroy(asgn1_device.class, asgn1_device.dev);
-    class_destroy(asgn1_device.class);
-    
-    printk(KERN_WARNING "asgn1: cleaned up udev entry\n");
+    int result;
+    int i;
 
-    free_memory_pages();
-    unregister_chrdev_region(asgn1_device.dev, 1);
     remove_proc_entry(MYDEV_NAME, NULL);
-    cdev_del(asgn1_device.cdev);
+    if (shrink)
+        unregister_shrinker(&asgn1_shrinker);
+
+    // a disk written behind only has its last writes left to flush
+    for (i = 0; backing != NULL && i < num_devices; i++) {
+        cancel_delayed_work_sync(&asgn1_devices[i].flush_work);
+        if (asgn1_devices[i].wb_file != NULL)
+            result = asgn1_sync(&asgn1_devices[i]);
+        else
+            result = asgn1_save_device(&asgn1_devices[i], i);
+        if (result < 0)
+            printk(KERN_WARNING "asgn1: %s%d: can't save to backing file\n", MYDEV_NAME, i);
+    }
+    for (i = 0; i < num_devices; i++)
+        asgn1_teardown_device(&asgn1_devices[i]);
+    if (disk_mib > 0)
+        unregister_blkdev(asgn1_blk_major, MYDEV_NAME);
+    class_destroy(asgn1_class);
+    
+    printk(KERN_WARNING "asgn1: cleaned up udev entries\n");
+
+    unregister_chrdev_region(MKDEV(asgn1_major, asgn1_minor), num_devices);
+    kfree(asgn1_devices);
+    asgn1_drain_frees();
+    asgn1_free_tfms();
+    kmem_cache_destroy(asgn1_node_cache);
 
     printk(KERN_WARNING "asgn1: Good bye from %s\n", MYDEV_NAME);
 }
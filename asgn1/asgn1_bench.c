@@ -0,0 +1,1515 @@
+/**
+ * File: asgn1_bench.c
+ * Author: Ashley Manson
+ *
+ * Benchmarks for the asgn1 virtual ramdisk.
+ *
+ * Usage: asgn1_bench <test> [device] [options...]
+ *
+ *   lookup [device] [max_mib] [ops]
+ *       Grows the device from 1 MiB to max_mib (doubling each step) and
+ *       times random 4 KiB reads at every size. With an indexed page store
+ *       the per-op latency should stay flat as the device grows.
+ *
+ *   fill [device] [size_mib]
+ *       Times filling an empty device with size_mib (default 1024) of
+ *       sequential 1 MiB writes, which is dominated by page allocation.
+ *
+ *   readers [device] [size_mib] [max_threads] [seconds]
+ *       Fills size_mib (default 256) and then runs 1, 2, 4, ... up to
+ *       max_threads (default: online CPUs) threads doing random 64 KiB
+ *       preads on one descriptor, reporting aggregate throughput. Reads
+ *       take no locks in the driver, so this should scale with threads.
+ *
+ *   writers [device] [size_mib] [max_threads] [seconds]
+ *       Splits size_mib (default 256) into one slot per thread and runs
+ *       1, 2, 4, ... up to max_threads threads, each rewriting its own slot
+ *       with 64 KiB pwrites. Writes to disjoint ranges do not wait for each
+ *       other, so this should scale with threads too.
+ *
+ *   splice [device] [size_mib] [output]
+ *       Fills size_mib (default 256) and ships it to output, by default a
+ *       socket drained by another thread, first with a read()/write() loop
+ *       and then with sendfile(), which splices the device pages without
+ *       copying them through user space.
+ *
+ *   truncate [device] [max_mib]
+ *       Fills the device to 64 MiB, 128 MiB, ... up to max_mib (default
+ *       4096) and times the open(O_WRONLY) that empties it at each size.
+ *       The pages are freed in the background, so this should stay flat.
+ *
+ *   window [device] [window_mib] [total_mib]
+ *       Appends total_mib (default 4096) in 1 MiB writes while punching out
+ *       everything more than window_mib (default 64) behind the end, as a
+ *       producer recycling space in a rolling window would, and reports the
+ *       rate and the pages held at the end, which should be the window.
+ *       Then fills the device to 128 MiB, 256 MiB, ... up to total_mib and
+ *       times truncating the last 64 MiB off at each size, which should
+ *       stay flat since only the pages freed cost anything.
+ *
+ *   limit [device] [limit_mib] [ops]
+ *       Sets a limit of limit_mib (default 256) and times filling the device
+ *       with 1 MiB writes until they fail with ENOSPC, then times ops
+ *       (default 10000) 4 KiB writes past the limit, which should fail fast
+ *       rather than push the machine into reclaim. Then marks the whole
+ *       device discardable and prints the pages left after dropping caches,
+ *       which asks the shrinker for them if asgn1 was loaded with shrink=1.
+ *       Needs root.
+ *
+ *   unload [device] [module] [max_mib]
+ *       As truncate, but times rmmod of a full device instead, reloading
+ *       module (default ./asgn1.ko) after each size. Needs root.
+ *
+ *   restart [device] [module] [size_mib] [backing]
+ *       Fills size_mib (default 1024), then times rmmod, which saves the
+ *       disk to backing.0 (default /var/tmp/asgn1), and insmod of module
+ *       (default ./asgn1.ko) with backing set, which restores it, against
+ *       copying the saved image back in from user space 128 KiB at a time
+ *       as cat would. Needs root.
+ *
+ *   compress [device] [size_mib]
+ *       Fills size_mib (default 1024) with log-like text, waits for the
+ *       module's compress_secs to pass twice, and reports how much memory
+ *       the device takes and how long a cold read of it (decompressing
+ *       every page) takes against a warm one. Needs compress_secs set.
+ *
+ *   checksum [device] [size_mib]
+ *       Times sequential 1 MiB writes and reads of size_mib (default 1024)
+ *       and prints the checksum counters. Run it once with asgn1 loaded
+ *       with checksum=1 and once without; the difference is the cost of
+ *       the CRC32C, which should be small next to the copy itself.
+ *
+ *   digest [device] [size_mib] [chunk_kib]
+ *       Fills size_mib (default 1024) and times ASGN1_DIGEST over it with
+ *       one digest per chunk_kib (default 1024) in each algorithm, against
+ *       just reading it all out, which a userspace hash would need before
+ *       it even started. Then does the same for a device of the same size
+ *       with only every 16th MiB written, where the holes cost little.
+ *
+ *   dedup [device] [size_mib] [distinct]
+ *       Writes size_mib (default 1024) of pages cycling through distinct
+ *       (default 16) different contents, and reports the write throughput
+ *       and how many pages the module shared. Needs dedup=1.
+ *
+ *   prealloc [device] [size_mib]
+ *       Times each 4 KiB write of size_mib (default 256) written in order,
+ *       first to an empty device and then to one reserved with
+ *       ASGN1_PREALLOC, and reports the median, 99th and 99.9th percentile
+ *       and worst write latency of each.
+ *
+ *   nowait [device] [size_mib] [max_depth] [ops]
+ *       Fills size_mib (default 256) and at queue depths 1, 2, 4, ... up to
+ *       max_depth (default 64) issues ops (default 100000) 4 KiB aio
+ *       requests with RWF_NOWAIT through raw io_submit calls: random reads,
+ *       random overwrites, and appends, which need new pages. Reports the
+ *       rate, the share completed inline within io_submit, and the share
+ *       that returned EAGAIN and was retried synchronously, as io_uring
+ *       would punt it to a worker. The kernel asgn1 builds against predates
+ *       io_uring, so native aio, which honours RWF_NOWAIT the same way,
+ *       stands in for it.
+ *
+ *   writeback [device] [size_mib]
+ *       Times each 4 KiB write of size_mib (default 256), reporting the
+ *       latency spread as prealloc does, then times ASGN1_FSYNC and prints
+ *       the dirty and flushed counters. Needs backing and flush_secs set;
+ *       the write latency should match a device without them.
+ *
+ *   snapshot [device] [max_mib]
+ *       Fills the device to 64 MiB, 128 MiB, ... up to max_mib (default
+ *       1024) and at each size times ASGN1_SNAPSHOT, which should stay
+ *       flat, then a rewrite of the device while the snapshot is open,
+ *       which copies each page once, against one without, and finally
+ *       reads the snapshot back to check it kept the old contents.
+ *
+ *   stats [device] [polls]
+ *       Times polls (default 100000) ASGN1_GET_STATS ioctls against the
+ *       same number of reads of /proc/asgn1, then prints the counters.
+ *       The ioctl is what a monitoring agent should poll.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+#include "asgn1_ioctl.h"
+
+#define PAGE_SIZE 4096
+#define MIB (1024UL * 1024UL)
+#define MAX_DEPTH 256
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
+
+static char *filename = "/dev/asgn10";
+
+static void assert_alloc (void *p) {
+
+    if (p == NULL) {
+        fprintf (stderr, "out of memory\n");
+        exit (1);
+    }
+}
+
+static double now_ns (void) {
+
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int open_device (int flags) {
+
+    int fd;
+
+    if ((fd = open (filename, flags)) < 0) {
+        fprintf (stderr, "open of %s failed:  %s\n", filename,
+                 strerror (errno));
+        exit (1);
+    }
+    return fd;
+}
+
+/* Opening write-only empties the device. */
+static void reset_device (void) {
+
+    close (open_device (O_WRONLY));
+}
+
+/* Writes all of buf to fd, retrying short writes. */
+static ssize_t my_write (int fd, const char *buf, size_t len) {
+
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        n = write (fd, buf + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror ("write()");
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Writes a pattern from start up to end, growing the device. */
+static void fill_device (int fd, off_t start, off_t end) {
+
+    static char buf[MIB];
+    size_t len;
+
+    memset (buf, 0xa5, sizeof (buf));
+    while (start < end) {
+        len = end - start < (off_t)sizeof (buf) ? (size_t)(end - start) : sizeof (buf);
+        if (pwrite (fd, buf, len, start) != (ssize_t)len) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+        start += len;
+    }
+}
+
+static int bench_lookup (int argc, char **argv) {
+
+    unsigned long max_mib = 2048;
+    long ops = 100000;
+    unsigned long size_mib;
+    off_t size = 0;
+    long i;
+    int fd;
+    char buf[PAGE_SIZE];
+    double start, random_ns, tail_ns;
+
+    if (argc > 0)
+        max_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        ops = strtol (argv[1], NULL, 0);
+
+    srandom (getpid ());
+    reset_device ();
+    fd = open_device (O_RDWR);
+
+    printf ("%10s %16s %16s\n", "size_mib", "random_ns/op", "tail_ns/op");
+    for (size_mib = 1; size_mib <= max_mib; size_mib *= 2) {
+        fill_device (fd, size, size_mib * MIB);
+        size = size_mib * MIB;
+
+        start = now_ns ();
+        for (i = 0; i < ops; i++) {
+            off_t page = random () % (size / PAGE_SIZE);
+            if (pread (fd, buf, PAGE_SIZE, page * PAGE_SIZE) != PAGE_SIZE) {
+                fprintf (stderr, "read problem:  %s\n", strerror (errno));
+                exit (1);
+            }
+        }
+        random_ns = (now_ns () - start) / ops;
+
+        start = now_ns ();
+        for (i = 0; i < ops; i++) {
+            if (pread (fd, buf, PAGE_SIZE, size - PAGE_SIZE) != PAGE_SIZE) {
+                fprintf (stderr, "read problem:  %s\n", strerror (errno));
+                exit (1);
+            }
+        }
+        tail_ns = (now_ns () - start) / ops;
+
+        printf ("%10lu %16.0f %16.0f\n", size_mib, random_ns, tail_ns);
+    }
+
+    close (fd);
+    return 0;
+}
+
+static int bench_fill (int argc, char **argv) {
+
+    unsigned long size_mib = 1024;
+    double start, secs;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+
+    start = now_ns ();
+    fill_device (fd, 0, size_mib * MIB);
+    secs = (now_ns () - start) / 1e9;
+
+    printf ("filled %lu MiB in %.3f s (%.0f MiB/s)\n", size_mib, secs,
+            size_mib / secs);
+
+    close (fd);
+    return 0;
+}
+
+#define READ_CHUNK (64 * 1024)
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    off_t base;
+    off_t size;
+    volatile int *stop;
+    unsigned long long bytes;
+} worker;
+
+static void *reader_thread (void *arg) {
+
+    worker *w = arg;
+    unsigned int seed = (unsigned int)(unsigned long)w;
+    off_t chunks = w->size / READ_CHUNK;
+    char *buf;
+    ssize_t n;
+
+    assert_alloc (buf = malloc (READ_CHUNK));
+    while (!*w->stop) {
+        n = pread (w->fd, buf, READ_CHUNK, w->base + (rand_r (&seed) % chunks) * READ_CHUNK);
+        if (n < 0) {
+            perror ("pread()");
+            exit (1);
+        }
+        w->bytes += n;
+    }
+    free (buf);
+    return NULL;
+}
+
+static void *writer_thread (void *arg) {
+
+    worker *w = arg;
+    off_t pos = 0;
+    char *buf;
+    ssize_t n;
+
+    assert_alloc (buf = malloc (READ_CHUNK));
+    memset (buf, 0x5a, READ_CHUNK);
+    while (!*w->stop) {
+        n = pwrite (w->fd, buf, READ_CHUNK, w->base + pos);
+        if (n < 0) {
+            perror ("pwrite()");
+            exit (1);
+        }
+        w->bytes += n;
+        pos = (pos + READ_CHUNK) % w->size;
+    }
+    free (buf);
+    return NULL;
+}
+
+/*
+ * Runs nthreads copies of fn for the given time, returning bytes per second.
+ * With split set each thread gets its own slot of the device, otherwise they
+ * all share the whole of it.
+ */
+static double run_workers (void *(*fn)(void *), int fd, off_t size, int split,
+                           int nthreads, double seconds) {
+
+    worker *workers;
+    volatile int stop = 0;
+    unsigned long long bytes = 0;
+    double start;
+    int i;
+
+    assert_alloc (workers = calloc (nthreads, sizeof (*workers)));
+    start = now_ns ();
+    for (i = 0; i < nthreads; i++) {
+        workers[i].fd = fd;
+        workers[i].size = split ? size / nthreads : size;
+        workers[i].base = split ? i * workers[i].size : 0;
+        workers[i].stop = &stop;
+        if (pthread_create (&workers[i].thread, NULL, fn, &workers[i]) != 0) {
+            fprintf (stderr, "pthread_create failed\n");
+            exit (1);
+        }
+    }
+    usleep (seconds * 1e6);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join (workers[i].thread, NULL);
+        bytes += workers[i].bytes;
+    }
+    free (workers);
+    return bytes / ((now_ns () - start) / 1e9);
+}
+
+static int bench_readers (int argc, char **argv) {
+
+    unsigned long size_mib = 256;
+    long max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    double seconds = 2;
+    double rate, base = 0;
+    int nthreads;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        max_threads = strtol (argv[1], NULL, 0);
+    if (argc > 2)
+        seconds = strtod (argv[2], NULL);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    fill_device (fd, 0, size_mib * MIB);
+
+    printf ("%8s %12s %8s\n", "threads", "MiB/s", "scaling");
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        rate = run_workers (reader_thread, fd, size_mib * MIB, 0, nthreads, seconds) / MIB;
+        if (base == 0)
+            base = rate;
+        printf ("%8d %12.0f %8.2f\n", nthreads, rate, rate / base);
+    }
+
+    close (fd);
+    return 0;
+}
+
+static int bench_writers (int argc, char **argv) {
+
+    unsigned long size_mib = 256;
+    long max_threads = sysconf (_SC_NPROCESSORS_ONLN);
+    double seconds = 2;
+    double rate, base = 0;
+    int nthreads;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        max_threads = strtol (argv[1], NULL, 0);
+    if (argc > 2)
+        seconds = strtod (argv[2], NULL);
+
+    /* fill first so the runs measure copying rather than allocation */
+    reset_device ();
+    fd = open_device (O_RDWR);
+    fill_device (fd, 0, size_mib * MIB);
+
+    printf ("%8s %12s %8s\n", "threads", "MiB/s", "scaling");
+    for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        rate = run_workers (writer_thread, fd, size_mib * MIB, 1, nthreads, seconds) / MIB;
+        if (base == 0)
+            base = rate;
+        printf ("%8d %12.0f %8.2f\n", nthreads, rate, rate / base);
+    }
+
+    close (fd);
+    return 0;
+}
+
+#define SHIP_CHUNK MIB
+
+static void *drain_thread (void *arg) {
+
+    int fd = *(int *)arg;
+    char *buf;
+
+    assert_alloc (buf = malloc (SHIP_CHUNK));
+    while (read (fd, buf, SHIP_CHUNK) > 0)
+        ;
+    free (buf);
+    return NULL;
+}
+
+/* Ships size bytes of the device to out with read() and write(). */
+static void ship_copy (int fd, int out, off_t size) {
+
+    char *buf;
+    off_t pos = 0;
+    ssize_t n;
+
+    assert_alloc (buf = malloc (SHIP_CHUNK));
+    while (pos < size) {
+        n = pread (fd, buf, SHIP_CHUNK, pos);
+        if (n <= 0) {
+            fprintf (stderr, "read problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+        if (my_write (out, buf, n) != n)
+            exit (1);
+        pos += n;
+    }
+    free (buf);
+}
+
+/* Ships size bytes of the device to out with sendfile(). */
+static void ship_sendfile (int fd, int out, off_t size) {
+
+    off_t pos = 0;
+    ssize_t n;
+
+    while (pos < size) {
+        n = sendfile (out, fd, &pos, SHIP_CHUNK);
+        if (n <= 0) {
+            fprintf (stderr, "sendfile problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+}
+
+static int bench_splice (int argc, char **argv) {
+
+    unsigned long size_mib = 256;
+    int sv[2];
+    int fd, out;
+    pthread_t drain;
+    double start, copy_secs, splice_secs;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    fill_device (fd, 0, size_mib * MIB);
+
+    if (argc > 1) {
+        if ((out = open (argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            fprintf (stderr, "open of %s failed:  %s\n", argv[1], strerror (errno));
+            exit (1);
+        }
+    }
+    else {
+        if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            perror ("socketpair()");
+            exit (1);
+        }
+        out = sv[0];
+        pthread_create (&drain, NULL, drain_thread, &sv[1]);
+    }
+
+    start = now_ns ();
+    ship_copy (fd, out, size_mib * MIB);
+    copy_secs = (now_ns () - start) / 1e9;
+
+    start = now_ns ();
+    ship_sendfile (fd, out, size_mib * MIB);
+    splice_secs = (now_ns () - start) / 1e9;
+
+    printf ("%12s %12s\n", "method", "MiB/s");
+    printf ("%12s %12.0f\n", "read/write", size_mib / copy_secs);
+    printf ("%12s %12.0f\n", "sendfile", size_mib / splice_secs);
+
+    close (out);
+    if (argc <= 1) {
+        pthread_join (drain, NULL);
+        close (sv[1]);
+    }
+    close (fd);
+    return 0;
+}
+
+static int bench_truncate (int argc, char **argv) {
+
+    unsigned long max_mib = 4096;
+    unsigned long size_mib;
+    double start, open_us;
+    int fd;
+
+    if (argc > 0)
+        max_mib = strtoul (argv[0], NULL, 0);
+
+    printf ("%10s %12s\n", "size_mib", "open_us");
+    for (size_mib = 64; size_mib <= max_mib; size_mib *= 2) {
+        reset_device ();
+        fd = open_device (O_RDWR);
+        fill_device (fd, 0, size_mib * MIB);
+        close (fd);
+
+        start = now_ns ();
+        fd = open_device (O_WRONLY);
+        open_us = (now_ns () - start) / 1e3;
+        close (fd);
+
+        printf ("%10lu %12.0f\n", size_mib, open_us);
+    }
+    return 0;
+}
+
+static int bench_window (int argc, char **argv) {
+
+    unsigned long window_mib = 64, total_mib = 4096, mib;
+    struct asgn1_range range;
+    struct asgn1_stats stats;
+    static char buf[MIB];
+    double start, secs, trunc_us;
+    __u64 size;
+    off_t pos;
+    int fd;
+
+    if (argc > 0)
+        window_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        total_mib = strtoul (argv[1], NULL, 0);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    memset (buf, 0xa5, sizeof (buf));
+    start = now_ns ();
+    for (pos = 0; pos < (off_t)(total_mib * MIB); pos += MIB) {
+        if (pwrite (fd, buf, MIB, pos) != (ssize_t)MIB) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+        if (pos >= (off_t)(window_mib * MIB)) {
+            range.offset = pos - window_mib * MIB;
+            range.length = MIB;
+            if (ioctl (fd, ASGN1_PUNCH_HOLE, &range) < 0) {
+                fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+                exit (1);
+            }
+        }
+    }
+    secs = (now_ns () - start) / 1e9;
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("window %lu MiB: %.0f MiB/s appended, %llu pages held, %llu freed\n",
+            window_mib, total_mib / secs, (unsigned long long)stats.num_pages,
+            (unsigned long long)stats.pages_freed);
+    close (fd);
+
+    printf ("%10s %12s\n", "size_mib", "truncate_us");
+    for (mib = 128; mib <= total_mib; mib *= 2) {
+        reset_device ();
+        fd = open_device (O_RDWR);
+        fill_device (fd, 0, mib * MIB);
+        size = (mib - 64) * MIB;
+        start = now_ns ();
+        if (ioctl (fd, ASGN1_TRUNCATE, &size) < 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        trunc_us = (now_ns () - start) / 1e3;
+        printf ("%10lu %12.0f\n", mib, trunc_us);
+        close (fd);
+    }
+    return 0;
+}
+
+/* Runs a shell command, giving up on failure. */
+static void run (const char *cmd) {
+
+    if (system (cmd) != 0) {
+        fprintf (stderr, "%s failed\n", cmd);
+        exit (1);
+    }
+}
+
+static int bench_limit (int argc, char **argv) {
+
+    unsigned long limit_mib = 256;
+    long ops = 10000, i;
+    struct asgn1_discard discard;
+    struct asgn1_stats stats;
+    static char buf[MIB];
+    double start, fill_secs, fail_ns;
+    __u64 limit, none = 0;
+    off_t pos;
+    ssize_t n;
+    int fd;
+
+    if (argc > 0)
+        limit_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        ops = strtol (argv[1], NULL, 0);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    limit = limit_mib * MIB;
+    if (ioctl (fd, ASGN1_SET_LIMIT, &limit) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+
+    memset (buf, 0xa5, sizeof (buf));
+    start = now_ns ();
+    for (pos = 0; (n = pwrite (fd, buf, MIB, pos)) > 0; pos += n)
+        ;
+    fill_secs = (now_ns () - start) / 1e9;
+    if (n == 0 || errno != ENOSPC) {
+        fprintf (stderr, "expected ENOSPC, got:  %s\n", n == 0 ? "nothing" : strerror (errno));
+        exit (1);
+    }
+
+    start = now_ns ();
+    for (i = 0; i < ops; i++) {
+        if (pwrite (fd, buf, PAGE_SIZE, pos + i * PAGE_SIZE) >= 0 || errno != ENOSPC) {
+            fprintf (stderr, "write past the limit did not fail with ENOSPC\n");
+            exit (1);
+        }
+    }
+    fail_ns = (now_ns () - start) / ops;
+    printf ("filled %lld MiB of %lu in %.2f s, %.0f ns per write refused\n",
+            (long long)(pos / MIB), limit_mib, fill_secs, fail_ns);
+
+    discard.offset = 0;
+    discard.length = pos;
+    discard.discardable = 1;
+    discard.pad = 0;
+    if (ioctl (fd, ASGN1_DISCARDABLE, &discard) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    run ("echo 2 > /proc/sys/vm/drop_caches");
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("after drop_caches: %llu pages held, %llu discardable, %llu discarded\n",
+            (unsigned long long)stats.num_pages, (unsigned long long)stats.discardable_pages,
+            (unsigned long long)stats.discarded_pages);
+
+    ioctl (fd, ASGN1_SET_LIMIT, &none);
+    close (fd);
+    return 0;
+}
+
+/* Waits for udev to create the device node again after insmod. */
+static void wait_device (void) {
+
+    int tries;
+
+    for (tries = 0; access (filename, R_OK | W_OK) < 0 && tries < 100; tries++)
+        usleep (10000);
+}
+
+static int bench_unload (int argc, char **argv) {
+
+    const char *module = "./asgn1.ko";
+    unsigned long max_mib = 4096;
+    unsigned long size_mib;
+    char cmd[512];
+    double start, unload_ms;
+    int fd;
+
+    if (argc > 0)
+        module = argv[0];
+    if (argc > 1)
+        max_mib = strtoul (argv[1], NULL, 0);
+    snprintf (cmd, sizeof (cmd), "insmod %s", module);
+
+    printf ("%10s %12s\n", "size_mib", "unload_ms");
+    for (size_mib = 64; size_mib <= max_mib; size_mib *= 2) {
+        reset_device ();
+        fd = open_device (O_RDWR);
+        fill_device (fd, 0, size_mib * MIB);
+        close (fd);
+
+        start = now_ns ();
+        run ("rmmod asgn1");
+        unload_ms = (now_ns () - start) / 1e6;
+
+        printf ("%10lu %12.1f\n", size_mib, unload_ms);
+
+        run (cmd);
+        wait_device ();
+    }
+    return 0;
+}
+
+static int bench_restart (int argc, char **argv) {
+
+    const char *module = "./asgn1.ko";
+    const char *backing = "/var/tmp/asgn1";
+    unsigned long size_mib = 1024;
+    static char buf[128 * 1024];
+    char cmd[512], image[512];
+    double start, save_ms, restore_ms, cat_ms;
+    off_t pos;
+    ssize_t n;
+    int fd, in;
+
+    if (argc > 0)
+        module = argv[0];
+    if (argc > 1)
+        size_mib = strtoul (argv[1], NULL, 0);
+    if (argc > 2)
+        backing = argv[2];
+    snprintf (image, sizeof (image), "%s.0", backing);
+
+    run ("rmmod asgn1");
+    snprintf (cmd, sizeof (cmd), "insmod %s backing=%s", module, backing);
+    run (cmd);
+    wait_device ();
+    reset_device ();
+    fd = open_device (O_RDWR);
+    fill_device (fd, 0, size_mib * MIB);
+    close (fd);
+
+    start = now_ns ();
+    run ("rmmod asgn1");
+    save_ms = (now_ns () - start) / 1e6;
+
+    start = now_ns ();
+    run (cmd);
+    restore_ms = (now_ns () - start) / 1e6;
+    wait_device ();
+
+    // the image starts after a one page header
+    reset_device ();
+    if ((in = open (image, O_RDONLY)) < 0) {
+        fprintf (stderr, "open of %s failed:  %s\n", image, strerror (errno));
+        exit (1);
+    }
+    fd = open_device (O_RDWR);
+    start = now_ns ();
+    for (pos = PAGE_SIZE; (n = pread (in, buf, sizeof (buf), pos)) > 0; pos += n) {
+        if (my_write (fd, buf, n) != n)
+            exit (1);
+    }
+    cat_ms = (now_ns () - start) / 1e6;
+    close (fd);
+    close (in);
+
+    printf ("%10s %10s %12s %12s\n", "size_mib", "save_ms", "restore_ms", "cat_ms");
+    printf ("%10lu %10.1f %12.1f %12.1f\n", size_mib, save_ms, restore_ms, cat_ms);
+    return 0;
+}
+
+/* Reads a module parameter, or returns -1. */
+static long read_module_param (const char *name) {
+
+    char path[256];
+    FILE *f;
+    long value = -1;
+    int c;
+
+    snprintf (path, sizeof (path), "/sys/module/asgn1/parameters/%s", name);
+    if ((f = fopen (path, "r")) != NULL) {
+        // bool parameters read as Y or N
+        if (fscanf (f, "%ld", &value) != 1) {
+            c = fgetc (f);
+            value = c == 'Y' ? 1 : c == 'N' ? 0 : -1;
+        }
+        fclose (f);
+    }
+    return value;
+}
+
+/* Times reading the whole device, in seconds. */
+static double time_read_all (int fd, off_t size) {
+
+    static char buf[MIB];
+    double start = now_ns ();
+    off_t pos;
+
+    for (pos = 0; pos < size; pos += sizeof (buf)) {
+        if (pread (fd, buf, sizeof (buf), pos) < 0) {
+            fprintf (stderr, "read problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    return (now_ns () - start) / 1e9;
+}
+
+static int bench_compress (int argc, char **argv) {
+
+    static char buf[MIB];
+    unsigned long size_mib = 1024;
+    long secs = read_module_param ("compress_secs");
+    struct asgn1_stats stats;
+    size_t len = 0;
+    off_t pos;
+    double cold, warm;
+    int fd, line = 0;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (secs <= 0) {
+        fprintf (stderr, "load asgn1 with compress_secs=N first\n");
+        exit (1);
+    }
+
+    while (len < sizeof (buf) - 128) {
+        len += snprintf (buf + len, sizeof (buf) - len,
+                         "2015-09-01 12:%02d:%02d asgn1 worker %d: request %d served in %d us\n",
+                         line / 60 % 60, line % 60, line % 8, line, line * 37 % 1000);
+        line++;
+    }
+    memset (buf + len, '\n', sizeof (buf) - len);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    for (pos = 0; pos < (off_t)(size_mib * MIB); pos += sizeof (buf)) {
+        if (pwrite (fd, buf, sizeof (buf), pos) != sizeof (buf)) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+
+    printf ("waiting %lds for pages to go cold\n", 2 * secs);
+    sleep (2 * secs);
+
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("data %lu MiB, memory %.1f MiB, %llu of %llu pages compressed, ratio %.2f\n",
+            size_mib,
+            ((stats.num_pages - stats.compressed_pages - stats.dedup_saved) * PAGE_SIZE +
+             stats.compressed_bytes) / (double)MIB,
+            (unsigned long long)stats.compressed_pages, (unsigned long long)stats.num_pages,
+            stats.compressed_bytes ? stats.compressed_pages * PAGE_SIZE / (double)stats.compressed_bytes : 1.0);
+
+    cold = time_read_all (fd, size_mib * MIB);
+    warm = time_read_all (fd, size_mib * MIB);
+    printf ("%12s %12s\n", "read", "MiB/s");
+    printf ("%12s %12.0f\n", "cold", size_mib / cold);
+    printf ("%12s %12.0f\n", "warm", size_mib / warm);
+
+    close (fd);
+    return 0;
+}
+
+static int bench_checksum (int argc, char **argv) {
+
+    static char buf[MIB];
+    unsigned long size_mib = 1024;
+    long checksum = read_module_param ("checksum");
+    struct asgn1_stats stats;
+    double start, write_secs, overwrite_secs, read_secs;
+    off_t pos;
+    size_t i;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+
+    for (i = 0; i < sizeof (buf); i++)
+        buf[i] = random () % 256;
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    start = now_ns ();
+    for (pos = 0; pos < (off_t)(size_mib * MIB); pos += sizeof (buf)) {
+        if (pwrite (fd, buf, sizeof (buf), pos) != sizeof (buf)) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    write_secs = (now_ns () - start) / 1e9;
+    // the first pass allocated the pages, time overwriting them too
+    start = now_ns ();
+    for (pos = 0; pos < (off_t)(size_mib * MIB); pos += sizeof (buf)) {
+        if (pwrite (fd, buf, sizeof (buf), pos) != sizeof (buf)) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    overwrite_secs = (now_ns () - start) / 1e9;
+    read_secs = time_read_all (fd, size_mib * MIB);
+    printf ("checksum=%ld\n", checksum);
+    printf ("%12s %12s\n", "op", "MiB/s");
+    printf ("%12s %12.0f\n", "write", size_mib / write_secs);
+    printf ("%12s %12.0f\n", "overwrite", size_mib / overwrite_secs);
+    printf ("%12s %12.0f\n", "read", size_mib / read_secs);
+
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("crc_errors %llu, scrub_passes %llu, scrubbed_pages %llu\n",
+            (unsigned long long)stats.crc_errors, (unsigned long long)stats.scrub_passes,
+            (unsigned long long)stats.scrubbed_pages);
+
+    close (fd);
+    return 0;
+}
+
+static double time_digest (int fd, off_t size, __u64 chunk, __u32 algo) {
+
+    static __u8 digests[65536 * ASGN1_DIGEST_MAX];
+    struct asgn1_digest req;
+    double start = now_ns ();
+    off_t pos = 0;
+    long n;
+
+    while (pos < size) {
+        req.offset = pos;
+        req.length = size - pos;
+        req.chunk = chunk;
+        req.digests = (__u64)(unsigned long)digests;
+        req.nr = 65536;
+        req.algo = algo;
+        n = ioctl (fd, ASGN1_DIGEST, &req);
+        if (n <= 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", n == 0 ? "no digests" : strerror (errno));
+            exit (1);
+        }
+        pos += n * chunk;
+    }
+    return (now_ns () - start) / 1e9;
+}
+
+static int bench_digest (int argc, char **argv) {
+
+    static char buf[MIB];
+    unsigned long size_mib = 1024, chunk_kib = 1024;
+    static const char *names[] = { "crc32c", "sha256" };
+    __u64 size;
+    double secs;
+    off_t pos;
+    size_t i;
+    int fd, sparse;
+    __u32 algo;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        chunk_kib = strtoul (argv[1], NULL, 0);
+    if (chunk_kib == 0) {
+        fprintf (stderr, "chunk_kib must be at least 1\n");
+        exit (1);
+    }
+    size = size_mib * MIB;
+
+    for (i = 0; i < sizeof (buf); i++)
+        buf[i] = random () % 256;
+
+    printf ("%12s %12s %12s\n", "device", "op", "MiB/s");
+    for (sparse = 0; sparse < 2; sparse++) {
+        reset_device ();
+        fd = open_device (O_RDWR);
+        for (pos = 0; pos < (off_t)(size_mib * MIB); pos += sizeof (buf)) {
+            if (sparse && pos / MIB % 16 != 0)
+                continue;
+            if (pwrite (fd, buf, sizeof (buf), pos) != sizeof (buf)) {
+                fprintf (stderr, "write problem:  %s\n", strerror (errno));
+                exit (1);
+            }
+        }
+        // the device ends at the last write, so give it its full size
+        if (ioctl (fd, ASGN1_TRUNCATE, &size) < 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+
+        secs = time_read_all (fd, size_mib * MIB);
+        printf ("%12s %12s %12.0f\n", sparse ? "sparse" : "full", "read", size_mib / secs);
+        for (algo = ASGN1_DIGEST_CRC32C; algo <= ASGN1_DIGEST_SHA256; algo++) {
+            secs = time_digest (fd, size_mib * MIB, chunk_kib * 1024, algo);
+            printf ("%12s %12s %12.0f\n", sparse ? "sparse" : "full", names[algo], size_mib / secs);
+        }
+        close (fd);
+    }
+    return 0;
+}
+
+static int bench_dedup (int argc, char **argv) {
+
+    static char buf[MIB];
+    unsigned long size_mib = 1024;
+    unsigned long distinct = 16;
+    unsigned long page, npages = MIB / PAGE_SIZE;
+    struct asgn1_stats stats;
+    double start, secs;
+    off_t pos;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        distinct = strtoul (argv[1], NULL, 0);
+    if (read_module_param ("dedup") <= 0)
+        fprintf (stderr, "warning: asgn1 was not loaded with dedup=1\n");
+    if (distinct < 1)
+        distinct = 1;
+
+    for (page = 0; page < npages; page++) {
+        memset (buf + page * PAGE_SIZE, 0, PAGE_SIZE);
+        snprintf (buf + page * PAGE_SIZE, PAGE_SIZE, "block header %lu", page % distinct);
+    }
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    start = now_ns ();
+    for (pos = 0; pos < (off_t)(size_mib * MIB); pos += sizeof (buf)) {
+        if (pwrite (fd, buf, sizeof (buf), pos) != sizeof (buf)) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    secs = (now_ns () - start) / 1e9;
+
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("wrote %lu MiB at %.0f MiB/s, %llu of %llu pages shared, memory %.1f MiB\n",
+            size_mib, size_mib / secs,
+            (unsigned long long)stats.dedup_saved, (unsigned long long)stats.num_pages,
+            (stats.num_pages - stats.dedup_saved) * PAGE_SIZE / (double)MIB);
+
+    close (fd);
+    return 0;
+}
+
+static int cmp_double (const void *a, const void *b) {
+
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Writes size bytes a page at a time, reporting the latency spread. */
+static void time_page_writes (int fd, off_t size, const char *name) {
+
+    char buf[PAGE_SIZE];
+    size_t n = size / PAGE_SIZE, i;
+    double *lat, start;
+
+    lat = malloc (n * sizeof (*lat));
+    assert_alloc (lat);
+    memset (buf, 0x5a, sizeof (buf));
+    for (i = 0; i < n; i++) {
+        start = now_ns ();
+        if (pwrite (fd, buf, PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+        lat[i] = now_ns () - start;
+    }
+    qsort (lat, n, sizeof (*lat), cmp_double);
+    printf ("%12s %10.0f %10.0f %10.0f %10.0f\n", name, lat[n / 2],
+            lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+    free (lat);
+}
+
+static int bench_prealloc (int argc, char **argv) {
+
+    unsigned long size_mib = 256;
+    struct asgn1_prealloc req;
+    double start, secs;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+
+    printf ("%12s %10s %10s %10s %10s\n", "device", "p50_ns", "p99_ns", "p99.9_ns", "max_ns");
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    time_page_writes (fd, size_mib * MIB, "empty");
+    close (fd);
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    memset (&req, 0, sizeof (req));
+    req.length = size_mib * MIB;
+    req.node = -1;
+    start = now_ns ();
+    if (ioctl (fd, ASGN1_PREALLOC, &req) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    secs = (now_ns () - start) / 1e9;
+    time_page_writes (fd, size_mib * MIB, "reserved");
+    printf ("preallocated %lu MiB in %.3f s\n", size_mib, secs);
+    close (fd);
+    return 0;
+}
+
+/*
+ * Runs ops 4 KiB aio requests depth at a time with RWF_NOWAIT, reading or
+ * writing at random pages of the first span bytes, or appending from *next
+ * if span is 0. Requests that return EAGAIN are retried without it. Adds
+ * the requests completed by the time io_submit returned to *inline_ops and
+ * the ones retried to *again, and returns the requests per second.
+ */
+static double run_aio (aio_context_t ctx, int fd, int write, off_t span, off_t *next,
+                       int depth, long ops, long *inline_ops, long *again) {
+
+    static struct iocb cbs[MAX_DEPTH];
+    static char bufs[MAX_DEPTH][PAGE_SIZE];
+    struct iocb *ptrs[MAX_DEPTH], *cb;
+    struct io_event events[MAX_DEPTH];
+    struct timespec zero = { 0, 0 };
+    unsigned long x = 88172645463325252UL;
+    long done = 0;
+    double start = now_ns ();
+    ssize_t n;
+    int i, nr, got;
+
+    memset (bufs, 0x3c, sizeof (bufs));
+    while (done < ops) {
+        nr = ops - done < depth ? ops - done : depth;
+        for (i = 0; i < nr; i++) {
+            cb = &cbs[i];
+            memset (cb, 0, sizeof (*cb));
+            cb->aio_fildes = fd;
+            cb->aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+            cb->aio_buf = (unsigned long)bufs[i];
+            cb->aio_nbytes = PAGE_SIZE;
+            cb->aio_rw_flags = RWF_NOWAIT;
+            if (span > 0) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                cb->aio_offset = (x % (span / PAGE_SIZE)) * PAGE_SIZE;
+            }
+            else {
+                cb->aio_offset = *next;
+                *next += PAGE_SIZE;
+            }
+            ptrs[i] = cb;
+        }
+        if (syscall (SYS_io_submit, ctx, (long)nr, ptrs) != nr) {
+            perror ("io_submit()");
+            exit (1);
+        }
+        got = syscall (SYS_io_getevents, ctx, 0L, (long)nr, events, &zero);
+        if (got < 0)
+            got = 0;
+        *inline_ops += got;
+        while (got < nr) {
+            n = syscall (SYS_io_getevents, ctx, 1L, (long)(nr - got), events + got, NULL);
+            if (n < 0) {
+                perror ("io_getevents()");
+                exit (1);
+            }
+            got += n;
+        }
+
+        // what would have blocked goes to a worker under io_uring
+        for (i = 0; i < nr; i++) {
+            cb = (struct iocb *)(unsigned long)events[i].obj;
+            if (events[i].res == -EAGAIN) {
+                (*again)++;
+                n = write ? pwrite (fd, (void *)(unsigned long)cb->aio_buf, PAGE_SIZE, cb->aio_offset)
+                          : pread (fd, (void *)(unsigned long)cb->aio_buf, PAGE_SIZE, cb->aio_offset);
+            }
+            else {
+                n = events[i].res;
+            }
+            if (n != PAGE_SIZE) {
+                fprintf (stderr, "aio problem:  %s\n", strerror (n < 0 ? -n : EIO));
+                exit (1);
+            }
+        }
+        done += nr;
+    }
+    return ops / ((now_ns () - start) / 1e9);
+}
+
+static int bench_nowait (int argc, char **argv) {
+
+    static const char *kinds[] = { "read", "overwrite", "append" };
+    unsigned long size_mib = 256;
+    long ops = 100000, inline_ops, again;
+    aio_context_t ctx = 0;
+    int max_depth = 64, depth, kind, fd;
+    off_t next;
+    double rate;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (argc > 1)
+        max_depth = atoi (argv[1]);
+    if (argc > 2)
+        ops = strtol (argv[2], NULL, 0);
+    if (max_depth > MAX_DEPTH)
+        max_depth = MAX_DEPTH;
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    fill_device (fd, 0, size_mib * MIB);
+    next = size_mib * MIB;
+    if (syscall (SYS_io_setup, (long)MAX_DEPTH, &ctx) < 0) {
+        perror ("io_setup()");
+        exit (1);
+    }
+
+    printf ("%10s %6s %12s %9s %9s\n", "op", "depth", "ops/s", "inline%", "again%");
+    for (kind = 0; kind < 3; kind++) {
+        for (depth = 1; depth <= max_depth; depth *= 2) {
+            inline_ops = again = 0;
+            rate = run_aio (ctx, fd, kind > 0, kind < 2 ? (off_t)(size_mib * MIB) : 0, &next,
+                            depth, ops, &inline_ops, &again);
+            printf ("%10s %6d %12.0f %9.1f %9.1f\n", kinds[kind], depth, rate,
+                    100.0 * inline_ops / ops, 100.0 * again / ops);
+        }
+    }
+
+    syscall (SYS_io_destroy, ctx);
+    close (fd);
+    return 0;
+}
+
+static int bench_writeback (int argc, char **argv) {
+
+    unsigned long size_mib = 256;
+    struct asgn1_stats stats;
+    double start, sync_ms;
+    int fd;
+
+    if (argc > 0)
+        size_mib = strtoul (argv[0], NULL, 0);
+    if (read_module_param ("flush_secs") <= 0)
+        fprintf (stderr, "warning: flush_secs is not set, nothing is written behind\n");
+
+    reset_device ();
+    fd = open_device (O_RDWR);
+    printf ("%12s %10s %10s %10s %10s\n", "device", "p50_ns", "p99_ns", "p99.9_ns", "max_ns");
+    time_page_writes (fd, size_mib * MIB, "writeback");
+
+    start = now_ns ();
+    if (ioctl (fd, ASGN1_FSYNC) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    sync_ms = (now_ns () - start) / 1e6;
+    if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+        fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    printf ("fsync took %.1f ms, %llu pages still dirty\n", sync_ms,
+            (unsigned long long)stats.dirty_pages);
+    printf ("flushed %.1f MiB at %.0f MiB/s\n", stats.flushed_bytes / (double)MIB,
+            stats.flush_ns ? stats.flushed_bytes / (double)MIB / (stats.flush_ns / 1e9) : 0);
+    close (fd);
+    return 0;
+}
+
+/* Overwrites the first size bytes with c, returning the seconds taken. */
+static double time_rewrite (int fd, off_t size, int c) {
+
+    static char buf[MIB];
+    double start = now_ns ();
+    off_t pos;
+
+    memset (buf, c, sizeof (buf));
+    for (pos = 0; pos < size; pos += sizeof (buf)) {
+        if (pwrite (fd, buf, sizeof (buf), pos) != (ssize_t)sizeof (buf)) {
+            fprintf (stderr, "write problem:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    return (now_ns () - start) / 1e9;
+}
+
+static int bench_snapshot (int argc, char **argv) {
+
+    unsigned long max_mib = 1024, mib;
+    static char buf[MIB];
+    double start, snap_us, plain, cow;
+    off_t pos;
+    int fd, snap, i;
+
+    if (argc > 0)
+        max_mib = strtoul (argv[0], NULL, 0);
+
+    printf ("%8s %12s %14s %14s\n", "size_mib", "snapshot_us", "rewrite_MiB/s", "cow_MiB/s");
+    for (mib = 64; mib <= max_mib; mib *= 2) {
+        reset_device ();
+        fd = open_device (O_RDWR);
+        fill_device (fd, 0, mib * MIB);
+        plain = time_rewrite (fd, mib * MIB, 0xa5);
+
+        start = now_ns ();
+        if ((snap = ioctl (fd, ASGN1_SNAPSHOT)) < 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        snap_us = (now_ns () - start) / 1e3;
+        cow = time_rewrite (fd, mib * MIB, 0x5a);
+
+        for (pos = 0; pos < (off_t)(mib * MIB); pos += sizeof (buf)) {
+            if (pread (snap, buf, sizeof (buf), pos) != (ssize_t)sizeof (buf)) {
+                fprintf (stderr, "snapshot read problem:  %s\n", strerror (errno));
+                exit (1);
+            }
+            for (i = 0; i < (int)sizeof (buf); i += PAGE_SIZE) {
+                if (buf[i] != (char)0xa5) {
+                    fprintf (stderr, "snapshot changed at %lld\n", (long long)pos + i);
+                    exit (1);
+                }
+            }
+        }
+
+        printf ("%8lu %12.1f %14.0f %14.0f\n", mib, snap_us, mib / plain, mib / cow);
+        close (snap);
+        close (fd);
+    }
+    return 0;
+}
+
+static void print_lat (const char *name, const __u64 *hist) {
+
+    int i;
+
+    printf ("%s_lat_ns", name);
+    for (i = 0; i < ASGN1_LAT_BUCKETS; i++) {
+        if (hist[i] != 0)
+            printf (" %llu:%llu", 1ULL << i, (unsigned long long)hist[i]);
+    }
+    printf ("\n");
+}
+
+static int bench_stats (int argc, char **argv) {
+
+    unsigned long polls = 100000, i;
+    struct asgn1_stats stats;
+    char buf[4096];
+    int fd, proc;
+    double start, ioctl_ns, proc_ns;
+
+    if (argc > 0)
+        polls = strtoul (argv[0], NULL, 0);
+
+    fd = open_device (O_RDONLY);
+    start = now_ns ();
+    for (i = 0; i < polls; i++) {
+        if (ioctl (fd, ASGN1_GET_STATS, &stats) < 0) {
+            fprintf (stderr, "ioctl failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    ioctl_ns = (now_ns () - start) / polls;
+
+    if ((proc = open ("/proc/asgn1", O_RDONLY)) < 0) {
+        fprintf (stderr, "open of /proc/asgn1 failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    start = now_ns ();
+    for (i = 0; i < polls; i++) {
+        if (pread (proc, buf, sizeof (buf), 0) < 0) {
+            fprintf (stderr, "read of /proc/asgn1 failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+    }
+    proc_ns = (now_ns () - start) / polls;
+    close (proc);
+
+    printf ("%12s %12s\n", "method", "ns/poll");
+    printf ("%12s %12.0f\n", "ioctl", ioctl_ns);
+    printf ("%12s %12.0f\n", "/proc", proc_ns);
+
+    printf ("read_ops %llu, read_bytes %llu\n",
+            (unsigned long long)stats.read_ops, (unsigned long long)stats.read_bytes);
+    printf ("write_ops %llu, write_bytes %llu\n",
+            (unsigned long long)stats.write_ops, (unsigned long long)stats.write_bytes);
+    printf ("pages_alloc %llu, pages_freed %llu, num_pages %llu, data_size %llu\n",
+            (unsigned long long)stats.pages_alloc, (unsigned long long)stats.pages_freed,
+            (unsigned long long)stats.num_pages, (unsigned long long)stats.data_size);
+    printf ("mmap_faults %llu, open_busy %llu\n",
+            (unsigned long long)stats.mmap_faults, (unsigned long long)stats.open_busy);
+    print_lat ("read", stats.read_lat);
+    print_lat ("write", stats.write_lat);
+    print_lat ("fault", stats.fault_lat);
+
+    close (fd);
+    return 0;
+}
+
+static void usage (void) {
+
+    fprintf (stderr, "usage: asgn1_bench <test> [device] [options...]\n");
+    fprintf (stderr, "tests: lookup fill readers writers splice truncate window limit unload restart compress checksum digest dedup prealloc nowait writeback snapshot stats\n");
+    exit (1);
+}
+
+int main (int argc, char **argv) {
+
+    if (argc < 2)
+        usage ();
+    if (argc > 2)
+        filename = argv[2];
+
+    if (strcmp (argv[1], "lookup") == 0)
+        return bench_lookup (argc - 3, argv + 3);
+    if (strcmp (argv[1], "fill") == 0)
+        return bench_fill (argc - 3, argv + 3);
+    if (strcmp (argv[1], "readers") == 0)
+        return bench_readers (argc - 3, argv + 3);
+    if (strcmp (argv[1], "writers") == 0)
+        return bench_writers (argc - 3, argv + 3);
+    if (strcmp (argv[1], "splice") == 0)
+        return bench_splice (argc - 3, argv + 3);
+    if (strcmp (argv[1], "truncate") == 0)
+        return bench_truncate (argc - 3, argv + 3);
+    if (strcmp (argv[1], "window") == 0)
+        return bench_window (argc - 3, argv + 3);
+    if (strcmp (argv[1], "limit") == 0)
+        return bench_limit (argc - 3, argv + 3);
+    if (strcmp (argv[1], "unload") == 0)
+        return bench_unload (argc - 3, argv + 3);
+    if (strcmp (argv[1], "restart") == 0)
+        return bench_restart (argc - 3, argv + 3);
+    if (strcmp (argv[1], "compress") == 0)
+        return bench_compress (argc - 3, argv + 3);
+    if (strcmp (argv[1], "checksum") == 0)
+        return bench_checksum (argc - 3, argv + 3);
+    if (strcmp (argv[1], "digest") == 0)
+        return bench_digest (argc - 3, argv + 3);
+    if (strcmp (argv[1], "dedup") == 0)
+        return bench_dedup (argc - 3, argv + 3);
+    if (strcmp (argv[1], "prealloc") == 0)
+        return bench_prealloc (argc - 3, argv + 3);
+    if (strcmp (argv[1], "nowait") == 0)
+        return bench_nowait (argc - 3, argv + 3);
+    if (strcmp (argv[1], "writeback") == 0)
+        return bench_writeback (argc - 3, argv + 3);
+    if (strcmp (argv[1], "snapshot") == 0)
+        return bench_snapshot (argc - 3, argv + 3);
+    if (strcmp (argv[1], "stats") == 0)
+        return bench_stats (argc - 3, argv + 3);
+
+    usage ();
+    return 1;
+}
@@ -0,0 +1,135 @@
+/**
+   File: asgn1_ioctl.h
+   Author: Ashley Manson
+   The ioctl interface of the asgn1 virtual ramdisk, shared by the module
+   and user programs.
+ */
+
+#ifndef ASGN1_IOCTL_H
+#define ASGN1_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define MYIOC_TYPE 'k'
+
+#define SET_NPROC_OP 1
+#define GET_STATS_OP 2
+#define PREALLOC_OP 3
+#define SET_CONTIG_OP 4
+#define SNAPSHOT_OP 5
+#define FSYNC_OP 6
+#define PUNCH_HOLE_OP 7
+#define TRUNCATE_OP 8
+#define SET_LIMIT_OP 9
+#define DISCARDABLE_OP 10
+#define DIGEST_OP 11
+
+/*
+ * Latency histograms have one bucket per power of two nanoseconds, bucket i
+ * counting operations that took [2^i, 2^(i+1)) ns; the last bucket also
+ * counts anything slower.
+ */
+#define ASGN1_LAT_BUCKETS 32
+
+/*
+ * Device statistics, totalled over all CPUs. New fields are only ever added
+ * at the end; the driver copies back as much as the caller's struct holds.
+ */
+struct asgn1_stats {
+    __u64 read_ops;           /* read and splice calls */
+    __u64 read_bytes;         /* bytes read or spliced */
+    __u64 write_ops;          /* write calls */
+    __u64 write_bytes;        /* bytes written */
+    __u64 pages_alloc;        /* pages added to the device */
+    __u64 pages_freed;        /* pages freed from the device */
+    __u64 mmap_faults;        /* page faults on mappings of the device */
+    __u64 open_busy;          /* opens rejected with EBUSY */
+    __u64 num_pages;          /* pages currently held */
+    __u64 data_size;          /* current size of the device in bytes */
+    __u64 read_lat[ASGN1_LAT_BUCKETS];
+    __u64 write_lat[ASGN1_LAT_BUCKETS];
+    __u64 fault_lat[ASGN1_LAT_BUCKETS];
+    __u64 compressed_pages;   /* of num_pages, how many are compressed */
+    __u64 compressed_bytes;   /* memory those compressed pages take up */
+    __u64 dedup_saved;        /* of num_pages, how many share another's memory */
+    __u64 dirty_pages;        /* pages not yet written behind to the backing file */
+    __u64 flushed_bytes;      /* bytes written behind so far */
+    __u64 flush_ns;           /* time spent writing them */
+    __u64 nowait_again;       /* IOCB_NOWAIT reads and writes that returned EAGAIN */
+    __u64 limit_bytes;        /* most the device may hold, 0 for no limit */
+    __u64 discardable_pages;  /* of num_pages, how many the shrinker may drop */
+    __u64 discarded_pages;    /* pages dropped by the shrinker so far */
+    __u64 crc_errors;         /* reads and scrubs that found a page failing its checksum */
+    __u64 scrub_passes;       /* passes the scrubber has finished */
+    __u64 scrubbed_pages;     /* pages the scrubber has checked so far */
+    __u64 scrub_offset;       /* how far it is into the current pass, in bytes */
+};
+
+/*
+ * A range of the device to allocate up front, much like fallocate. Writes
+ * inside it then never wait on the page allocator.
+ */
+struct asgn1_prealloc {
+    __u64 offset;             /* start of the range in bytes */
+    __u64 length;             /* length of the range in bytes */
+    __u32 flags;              /* ASGN1_PREALLOC_* */
+    __s32 node;               /* NUMA node to take the pages from, or -1 for any */
+};
+
+#define ASGN1_PREALLOC_KEEP_SIZE 0x1 /* don't grow the device to cover the range */
+#define ASGN1_PREALLOC_ZERO      0x2 /* also zero any data already in the range */
+
+/*
+ * A byte range of the device to punch a hole in, see ASGN1_PUNCH_HOLE.
+ */
+struct asgn1_range {
+    __u64 offset;             /* start of the range in bytes */
+    __u64 length;             /* length of the range in bytes */
+};
+
+/*
+ * A byte range of the device whose pages may be dropped under memory
+ * pressure, reading back as zeroes, or may no longer be, see
+ * ASGN1_DISCARDABLE. Only the pages in the range when it is marked are.
+ */
+struct asgn1_discard {
+    __u64 offset;             /* start of the range in bytes */
+    __u64 length;             /* length of the range in bytes */
+    __u32 discardable;        /* 1 to let the pages be dropped, 0 to keep them again */
+    __u32 pad;
+};
+
+/*
+ * A request for digests of a byte range of the device, one per chunk of it,
+ * see ASGN1_DIGEST. The range is cut at the end of the device, and the last
+ * chunk may be short. Digests are written one after another to digests, as
+ * many as fit in nr; the ioctl returns how many it wrote, so a caller can
+ * carry on from offset + that many chunks.
+ */
+struct asgn1_digest {
+    __u64 offset;             /* start of the range in bytes */
+    __u64 length;             /* length of the range in bytes */
+    __u64 chunk;              /* bytes per digest, 0 for one over the whole range */
+    __u64 digests;            /* address of room for nr digests */
+    __u32 nr;                 /* how many digests fit there */
+    __u32 algo;               /* ASGN1_DIGEST_* */
+};
+
+#define ASGN1_DIGEST_CRC32C 0 /* 4 bytes, the standard CRC32C, little endian */
+#define ASGN1_DIGEST_SHA256 1 /* 32 bytes */
+#define ASGN1_DIGEST_MAX 32   /* the longest digest */
+
+#define ASGN1_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, int)
+#define ASGN1_GET_STATS _IOR(MYIOC_TYPE, GET_STATS_OP, struct asgn1_stats)
+#define ASGN1_PREALLOC _IOW(MYIOC_TYPE, PREALLOC_OP, struct asgn1_prealloc)
+#define ASGN1_SET_CONTIG _IOW(MYIOC_TYPE, SET_CONTIG_OP, int) /* 1 to fill in 2 MiB chunks, device must be empty */
+#define ASGN1_SNAPSHOT _IO(MYIOC_TYPE, SNAPSHOT_OP) /* returns a read-only fd of the device as it is now */
+#define ASGN1_FSYNC _IO(MYIOC_TYPE, FSYNC_OP) /* waits until every write so far is in the backing file */
+#define ASGN1_PUNCH_HOLE _IOW(MYIOC_TYPE, PUNCH_HOLE_OP, struct asgn1_range) /* frees the pages of a range, size unchanged */
+#define ASGN1_TRUNCATE _IOW(MYIOC_TYPE, TRUNCATE_OP, __u64) /* sets the size, freeing the pages past it */
+#define ASGN1_SET_LIMIT _IOW(MYIOC_TYPE, SET_LIMIT_OP, __u64) /* bytes the device may hold, 0 for no limit */
+#define ASGN1_DISCARDABLE _IOW(MYIOC_TYPE, DISCARDABLE_OP, struct asgn1_discard)
+#define ASGN1_DIGEST _IOW(MYIOC_TYPE, DIGEST_OP, struct asgn1_digest) /* hashes a range on the device pages */
+
+#endif
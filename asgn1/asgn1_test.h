@@ -0,0 +1,105 @@
+/*
+ * Helpers shared by the asgn1 test programs run from test.sh. Each check
+ * prints what failed and exits with status 1, so a test just runs its
+ * checks in order.
+ */
+
+#ifndef ASGN1_TEST_H
+#define ASGN1_TEST_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include "asgn1_ioctl.h"
+
+#define TEST_DEVICE "/dev/asgn10" /* the device tested unless one is given */
+
+/* Checks a size or offset returned by a call. */
+static inline void expect_pos (off_t got, off_t want, const char *what) {
+
+    if (got != want) {
+        fprintf (stderr, "%s: got %lld, expected %lld (%s)\n", what,
+                 (long long)got, (long long)want, got < 0 ? strerror (errno) : "no error");
+        exit (1);
+    }
+}
+
+/* Checks that a call failed with err. */
+static inline void expect_errno (long result, int err, const char *what) {
+
+    if (result >= 0 || errno != err) {
+        fprintf (stderr, "%s: got %ld (%s), expected %s\n", what, result,
+                 result < 0 ? strerror (errno) : "no error", strerror (err));
+        exit (1);
+    }
+}
+
+/* Checks that bytes [from, to) of buf are zero. */
+static inline void expect_zeroes (const char *buf, size_t from, size_t to, const char *what) {
+
+    size_t i;
+
+    for (i = from; i < to; i++) {
+        if (buf[i] != 0) {
+            fprintf (stderr, "%s: byte %zu is %d, not zero\n", what, i, buf[i]);
+            exit (1);
+        }
+    }
+}
+
+/* Checks that len bytes of got are those of want. */
+static inline void expect_bytes (const char *got, const char *want, size_t len, const char *what) {
+
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (got[i] != want[i]) {
+            fprintf (stderr, "%s: byte %zu is %d, expected %d\n", what, i, got[i], want[i]);
+            exit (1);
+        }
+    }
+}
+
+static inline void *test_alloc (size_t size) {
+
+    void *buf;
+
+    if ((buf = calloc (1, size)) == NULL) {
+        fprintf (stderr, "out of memory\n");
+        exit (1);
+    }
+    return buf;
+}
+
+static inline int open_device (const char *filename, int flags) {
+
+    int fd;
+
+    if ((fd = open (filename, flags)) < 0) {
+        fprintf (stderr, "open of %s failed:  %s\n", filename, strerror (errno));
+        exit (1);
+    }
+    return fd;
+}
+
+/* Empties the device, as opening it write-only does, and opens it read-write. */
+static inline int open_empty (const char *filename) {
+
+    close (open_device (filename, O_WRONLY));
+    return open_device (filename, O_RDWR);
+}
+
+static inline void get_stats (int fd, struct asgn1_stats *stats) {
+
+    if (ioctl (fd, ASGN1_GET_STATS, stats) < 0) {
+        fprintf (stderr, "ASGN1_GET_STATS failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+}
+
+#endif
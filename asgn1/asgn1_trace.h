@@ -0,0 +1,164 @@
+/**
+ * File: asgn1_trace.h
+ * Author: Ashley Manson
+ *
+ * Tracepoints for the asgn1 virtual ramdisk. They cost nothing unless
+ * enabled, e.g. through /sys/kernel/debug/tracing/events/asgn1/ or
+ * perf record -e 'asgn1:*'.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM asgn1
+
+#if !defined(_ASGN1_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ASGN1_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * A whole read, write or splice call and what it returned.
+ */
+DECLARE_EVENT_CLASS(asgn1_io,
+
+    TP_PROTO(int minor, loff_t pos, size_t count, ssize_t result),
+
+    TP_ARGS(minor, pos, count, result),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, result)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->result = result;
+    ),
+
+    TP_printk("minor=%d pos=%lld count=%zu result=%zd",
+              __entry->minor, __entry->pos, __entry->count, __entry->result)
+);
+
+DEFINE_EVENT(asgn1_io, asgn1_read,
+    TP_PROTO(int minor, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(minor, pos, count, result));
+
+DEFINE_EVENT(asgn1_io, asgn1_write,
+    TP_PROTO(int minor, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(minor, pos, count, result));
+
+DEFINE_EVENT(asgn1_io, asgn1_splice_read,
+    TP_PROTO(int minor, loff_t pos, size_t count, ssize_t result),
+    TP_ARGS(minor, pos, count, result));
+
+/**
+ * One page copied by a read or write.
+ */
+DECLARE_EVENT_CLASS(asgn1_page,
+
+    TP_PROTO(int minor, unsigned long index, size_t offset, size_t len, size_t copied),
+
+    TP_ARGS(minor, index, offset, len, copied),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, index)
+        __field(size_t, offset)
+        __field(size_t, len)
+        __field(size_t, copied)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->index = index;
+        __entry->offset = offset;
+        __entry->len = len;
+        __entry->copied = copied;
+    ),
+
+    TP_printk("minor=%d page=%lu offset=%zu len=%zu copied=%zu",
+              __entry->minor, __entry->index, __entry->offset,
+              __entry->len, __entry->copied)
+);
+
+DEFINE_EVENT(asgn1_page, asgn1_read_page,
+    TP_PROTO(int minor, unsigned long index, size_t offset, size_t len, size_t copied),
+    TP_ARGS(minor, index, offset, len, copied));
+
+DEFINE_EVENT(asgn1_page, asgn1_write_page,
+    TP_PROTO(int minor, unsigned long index, size_t offset, size_t len, size_t copied),
+    TP_ARGS(minor, index, offset, len, copied));
+
+/**
+ * A run of pages added to or freed from a device.
+ */
+DECLARE_EVENT_CLASS(asgn1_pages,
+
+    TP_PROTO(int minor, unsigned long index, unsigned int count, int num_pages),
+
+    TP_ARGS(minor, index, count, num_pages),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, index)
+        __field(unsigned int, count)
+        __field(int, num_pages)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->index = index;
+        __entry->count = count;
+        __entry->num_pages = num_pages;
+    ),
+
+    TP_printk("minor=%d page=%lu count=%u num_pages=%d",
+              __entry->minor, __entry->index, __entry->count,
+              __entry->num_pages)
+);
+
+DEFINE_EVENT(asgn1_pages, asgn1_pages_alloc,
+    TP_PROTO(int minor, unsigned long index, unsigned int count, int num_pages),
+    TP_ARGS(minor, index, count, num_pages));
+
+DEFINE_EVENT(asgn1_pages, asgn1_pages_free,
+    TP_PROTO(int minor, unsigned long index, unsigned int count, int num_pages),
+    TP_ARGS(minor, index, count, num_pages));
+
+/**
+ * A page fault on a mapping of a device.
+ */
+TRACE_EVENT(asgn1_fault,
+
+    TP_PROTO(int minor, unsigned long pgoff, unsigned long address, unsigned int flags),
+
+    TP_ARGS(minor, pgoff, address, flags),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(unsigned long, pgoff)
+        __field(unsigned long, address)
+        __field(unsigned int, flags)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pgoff = pgoff;
+        __entry->address = address;
+        __entry->flags = flags;
+    ),
+
+    TP_printk("minor=%d page=%lu address=%lx flags=%x",
+              __entry->minor, __entry->pgoff, __entry->address, __entry->flags)
+);
+
+#endif /* _ASGN1_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE asgn1_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,94 @@
+/*
+ * Checks that an asgn1 device loaded with a backing file comes back after
+ * the module is reloaded: "save" fills the device, and "restore", run once
+ * test.sh has reloaded the module, checks that the same data, holes and size
+ * are back. "grow" empties a device written behind and only grows it, so no
+ * page is dirty, and "grown" checks that after reloading it reads as zeroes
+ * rather than as what it held before it was emptied.
+ *
+ * Usage: backing_test save|restore|grow|grown [device]
+ */
+
+#include "asgn1_test.h"
+
+/* Pages 0 to 2 and part of page 10 of data, pages 3 to 9 a hole. */
+static off_t fill (char *buf, off_t page) {
+
+    off_t i, size = 10 * page + 300;
+
+    memset (buf, 0, size);
+    for (i = 0; i < 3 * page; i++)
+        buf[i] = i * 17 + (i >> 12);
+    memcpy (buf + 10 * page, buf + 5, 300);
+    return size;
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_stats stats;
+    char *data, *buf;
+    off_t size;
+    __u64 grown;
+    int fd;
+
+    if (argc < 2) {
+        fprintf (stderr, "Usage: %s save|restore|grow|grown [device]\n", argv[0]);
+        exit (1);
+    }
+    if (argc > 2)
+        filename = argv[2];
+    data = test_alloc (11 * page);
+    buf = test_alloc (11 * page);
+    size = fill (data, page);
+
+    if (strcmp (argv[1], "save") == 0) {
+        fd = open_empty (filename);
+        expect_pos (pwrite (fd, data, 3 * page, 0), 3 * page, "write of pages 0 to 2");
+        expect_pos (pwrite (fd, data + 10 * page, 300, 10 * page), 300, "write of page 10");
+        printf ("device filled to be saved\n");
+    }
+    else if (strcmp (argv[1], "restore") == 0) {
+        fd = open_device (filename, O_RDONLY);
+        expect_pos (lseek (fd, 0, SEEK_END), size, "size after reloading");
+        get_stats (fd, &stats);
+        if (stats.num_pages != 4) {
+            fprintf (stderr, "device holds %llu pages after reloading, expected 4\n",
+                     (unsigned long long)stats.num_pages);
+            exit (1);
+        }
+        memset (buf, 0xff, 11 * page);
+        expect_pos (pread (fd, buf, 11 * page, 0), size, "read after reloading");
+        expect_bytes (buf, data, size, "device after reloading");
+        expect_pos (lseek (fd, 0, SEEK_HOLE), 3 * page, "SEEK_HOLE after reloading");
+        expect_pos (lseek (fd, 3 * page, SEEK_DATA), 10 * page, "SEEK_DATA after reloading");
+        printf ("device restored from its backing file\n");
+    }
+    else if (strcmp (argv[1], "grow") == 0) {
+        fd = open_empty (filename);
+        grown = 12 * page;
+        if (ioctl (fd, ASGN1_TRUNCATE, &grown) < 0 || ioctl (fd, ASGN1_FSYNC) < 0) {
+            fprintf (stderr, "grow and sync of the emptied device failed:  %s\n", strerror (errno));
+            exit (1);
+        }
+        printf ("emptied device grown and synced\n");
+    }
+    else if (strcmp (argv[1], "grown") == 0) {
+        fd = open_device (filename, O_RDONLY);
+        expect_pos (lseek (fd, 0, SEEK_END), 12 * page, "size after reloading");
+        memset (buf, 0xff, 11 * page);
+        expect_pos (pread (fd, buf, 11 * page, 0), 11 * page, "read after reloading");
+        expect_zeroes (buf, 0, 11 * page, "emptied device after reloading");
+        printf ("emptied device stays empty after reloading\n");
+    }
+    else {
+        fprintf (stderr, "unknown mode %s\n", argv[1]);
+        exit (1);
+    }
+
+    free (data);
+    free (buf);
+    close (fd);
+    return 0;
+}
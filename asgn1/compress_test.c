@@ -0,0 +1,90 @@
+/*
+ * Checks that compressing idle pages of an asgn1 device keeps their data:
+ * once the background pass has compressed them, a read, a write into part
+ * of a compressed page and a mapping all see what was written. Needs the
+ * module loaded with compress_secs set, test.sh uses 1.
+ *
+ * Usage: compress_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/mman.h>
+
+#define NR_PAGES 64
+#define WAIT_SECS 30
+
+/* Waits for the background pass to compress at least nr pages. */
+static void wait_compressed (int fd, unsigned long long nr, const char *what) {
+
+    struct asgn1_stats stats;
+    int i;
+
+    for (i = 0; i < WAIT_SECS * 10; i++) {
+        get_stats (fd, &stats);
+        if (stats.compressed_pages >= nr)
+            return;
+        usleep (100000);
+    }
+    fprintf (stderr, "%s: %llu pages compressed after %d s, expected %llu\n", what,
+             (unsigned long long)stats.compressed_pages, WAIT_SECS, nr);
+    exit (1);
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    off_t size = NR_PAGES * page, i;
+    struct asgn1_stats stats;
+    char *data, *buf, *map;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* text that compresses well, with a page of noise that won't */
+    data = test_alloc (size);
+    buf = test_alloc (size);
+    for (i = 0; i < size; i++)
+        data[i] = "asgn1 keeps its cold pages compressed\n"[i % 38] + (i / page) % 3;
+    srandom (1);
+    for (i = 5 * page; i < 6 * page; i++)
+        data[i] = random ();
+    expect_pos (pwrite (fd, data, size, 0), size, "write");
+
+    wait_compressed (fd, NR_PAGES / 2, "after writing");
+    get_stats (fd, &stats);
+    if (stats.compressed_bytes >= stats.compressed_pages * page) {
+        fprintf (stderr, "%llu compressed pages take %llu bytes\n",
+                 (unsigned long long)stats.compressed_pages, (unsigned long long)stats.compressed_bytes);
+        exit (1);
+    }
+    expect_pos (pread (fd, buf, size, 0), size, "read of compressed pages");
+    expect_bytes (buf, data, size, "compressed pages read back");
+    printf ("compressed pages read back intact\n");
+
+    /* a write into part of a compressed page keeps the rest of it */
+    wait_compressed (fd, NR_PAGES / 2, "after reading");
+    expect_pos (pwrite (fd, "written", 7, 3 * page + 1000), 7, "write into a compressed page");
+    memcpy (data + 3 * page + 1000, "written", 7);
+    expect_pos (pread (fd, buf, size, 0), size, "read after the write");
+    expect_bytes (buf, data, size, "pages after a write into one");
+    printf ("writes into compressed pages keep the rest of them\n");
+
+    /* and a mapping sees them as they were written */
+    wait_compressed (fd, NR_PAGES / 2, "after writing again");
+    map = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap()");
+        exit (1);
+    }
+    expect_bytes (map, data, size, "compressed pages mapped");
+    munmap (map, size);
+    printf ("compressed pages map intact\n");
+
+    free (data);
+    free (buf);
+    close (fd);
+    return 0;
+}
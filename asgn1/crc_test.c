@@ -0,0 +1,111 @@
+/*
+ * Checks that the page checksums of an asgn1 device keep up with every way
+ * of changing a page: small writes, which update the checksum from what
+ * they change, full and unaligned writes, and writes through a mapping, also
+ * followed by small writes once the scrubber has sealed the page again. No
+ * read and no scrub pass may find a page failing its checksum. Needs the
+ * module loaded with checksum and scrub_secs set, test.sh uses 1.
+ *
+ * Usage: crc_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/mman.h>
+
+#define NR_PAGES 16
+#define WAIT_SECS 30
+
+/* Waits for the scrubber to finish two more passes, so one ran whole. */
+static void wait_scrub (int fd, const char *what) {
+
+    struct asgn1_stats stats;
+    unsigned long long passes;
+    int i;
+
+    get_stats (fd, &stats);
+    passes = stats.scrub_passes;
+    for (i = 0; i < WAIT_SECS * 10; i++) {
+        get_stats (fd, &stats);
+        if (stats.scrub_passes >= passes + 2)
+            return;
+        usleep (100000);
+    }
+    fprintf (stderr, "%s: no scrub pass in %d s\n", what, WAIT_SECS);
+    exit (1);
+}
+
+static void expect_no_errors (int fd, const char *what) {
+
+    struct asgn1_stats stats;
+
+    get_stats (fd, &stats);
+    if (stats.crc_errors != 0) {
+        fprintf (stderr, "%s: %llu checksum errors\n", what, (unsigned long long)stats.crc_errors);
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    off_t size = NR_PAGES * page, i;
+    char *data, *buf, *map;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+    data = test_alloc (size);
+    buf = test_alloc (size);
+
+    /* full pages, then writes of many sizes at odd offsets within them */
+    for (i = 0; i < size; i++)
+        data[i] = i * 7 + (i >> 10);
+    expect_pos (pwrite (fd, data, size, 0), size, "write of full pages");
+    for (i = 0; i < NR_PAGES; i++) {
+        memset (data + i * page + i * 37, 'a' + i, 1 + i * 200);
+        expect_pos (pwrite (fd, data + i * page + i * 37, 1 + i * 200, i * page + i * 37),
+                    1 + i * 200, "small write");
+    }
+    memset (data + 3 * page - 10, 'u', page + 20);
+    expect_pos (pwrite (fd, data + 3 * page - 10, page + 20, 3 * page - 10), page + 20, "unaligned write");
+    expect_pos (pread (fd, buf, size, 0), size, "read after writing");
+    expect_bytes (buf, data, size, "device after writing");
+    expect_no_errors (fd, "after writing");
+    printf ("writes keep the checksums right\n");
+
+    /* writes through a mapping, with writes beside them */
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap()");
+        exit (1);
+    }
+    for (i = 0; i < NR_PAGES; i += 2) {
+        map[i * page + 100] = 'm';
+        data[i * page + 100] = 'm';
+    }
+    expect_pos (pwrite (fd, "beside", 6, 4 * page + 200), 6, "small write to a mapped page");
+    memcpy (data + 4 * page + 200, "beside", 6);
+    expect_pos (pread (fd, buf, size, 0), size, "read of mapped pages");
+    expect_bytes (buf, data, size, "device after mapped writes");
+    munmap (map, size);
+    wait_scrub (fd, "after mapped writes");
+    expect_no_errors (fd, "after mapped writes");
+
+    /* small writes again, on pages sealed by the scrubber */
+    for (i = 0; i < NR_PAGES; i += 2) {
+        expect_pos (pwrite (fd, "sealed", 6, i * page + 300), 6, "small write to a sealed page");
+        memcpy (data + i * page + 300, "sealed", 6);
+    }
+    wait_scrub (fd, "after sealing");
+    expect_pos (pread (fd, buf, size, 0), size, "read after sealing");
+    expect_bytes (buf, data, size, "device after sealing");
+    expect_no_errors (fd, "after sealing");
+    printf ("mapped writes keep the checksums right\n");
+
+    free (data);
+    free (buf);
+    close (fd);
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Checks that sharing identical pages of an asgn1 device keeps each copy's
+ * data: identical full pages written end up sharing memory, and a later
+ * write to one of them, through write or a mapping, changes only that one.
+ * Mapped pages get a private copy too. Needs the module loaded with dedup
+ * set.
+ *
+ * Usage: dedup_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/mman.h>
+
+#define NR_PAGES 8
+
+static void expect_saved (int fd, unsigned long long want, const char *what) {
+
+    struct asgn1_stats stats;
+
+    get_stats (fd, &stats);
+    if (stats.dedup_saved != want) {
+        fprintf (stderr, "%s: %llu pages shared, expected %llu\n", what,
+                 (unsigned long long)stats.dedup_saved, want);
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    off_t size = NR_PAGES * page, i;
+    char *data, *buf, *map;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* the same header page over and over */
+    data = test_alloc (size);
+    buf = test_alloc (size);
+    for (i = 0; i < size; i++)
+        data[i] = "HDR1" [i % 4] + i % page % 7;
+    expect_pos (pwrite (fd, data, size, 0), size, "write of identical pages");
+    expect_saved (fd, NR_PAGES - 1, "after writing");
+    expect_pos (pread (fd, buf, size, 0), size, "read of shared pages");
+    expect_bytes (buf, data, size, "shared pages read back");
+    printf ("identical pages share memory and read back intact\n");
+
+    /* a write to a shared page copies it first */
+    expect_pos (pwrite (fd, "mine", 4, 2 * page + 10), 4, "write into a shared page");
+    memcpy (data + 2 * page + 10, "mine", 4);
+    expect_saved (fd, NR_PAGES - 2, "after the write");
+    expect_pos (pread (fd, buf, size, 0), size, "read after the write");
+    expect_bytes (buf, data, size, "pages after a write into one");
+
+    /* and so does a write through a mapping */
+    map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap()");
+        exit (1);
+    }
+    map[5 * page + 20] = '!';
+    data[5 * page + 20] = '!';
+    expect_bytes (map, data, size, "mapping after a write through it");
+    munmap (map, size);
+    expect_saved (fd, 0, "after mapping");
+    expect_pos (pread (fd, buf, size, 0), size, "read after the mapped write");
+    expect_bytes (buf, data, size, "pages after a mapped write into one");
+    printf ("writes to shared pages copy them first\n");
+
+    free (data);
+    free (buf);
+    close (fd);
+    return 0;
+}
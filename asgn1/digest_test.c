@@ -0,0 +1,162 @@
+/*
+ * Checks ASGN1_DIGEST on an asgn1 device against digests computed here over
+ * the same bytes read back: CRC32C per chunk, aligned or not, over holes and
+ * a short last chunk, whole ranges, ranges cut at the end of the device,
+ * requests carried on when nr runs out, and SHA-256 against a known value.
+ *
+ * Usage: digest_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <stdint.h>
+
+#define MAX_CHUNKS 64
+
+/* The standard CRC32C, bit at a time, as slow as it is obviously right. */
+static uint32_t crc32c (const unsigned char *buf, size_t len) {
+
+    uint32_t crc = ~0U;
+    int bit;
+
+    while (len-- > 0) {
+        crc ^= *buf++;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/* Returns how many digests the device wrote to out for the request. */
+static int digest (int fd, __u32 algo, off_t offset, off_t length, off_t chunk, __u32 nr,
+                   unsigned char *out) {
+
+    struct asgn1_digest req;
+    int result;
+
+    req.offset = offset;
+    req.length = length;
+    req.chunk = chunk;
+    req.digests = (uintptr_t)out;
+    req.nr = nr;
+    req.algo = algo;
+    if ((result = ioctl (fd, ASGN1_DIGEST, &req)) < 0) {
+        fprintf (stderr, "digest of %lld bytes at %lld failed:  %s\n",
+                 (long long)length, (long long)offset, strerror (errno));
+        exit (1);
+    }
+    return result;
+}
+
+/* Checks CRC32C digests of [offset, end) in chunks against those of buf. */
+static void expect_crcs (const unsigned char *buf, const unsigned char *out, int nr,
+                         off_t offset, off_t end, off_t chunk, const char *what) {
+
+    uint32_t want;
+    off_t len;
+    int i;
+
+    for (i = 0; i < nr; i++, offset += chunk) {
+        len = end - offset < chunk ? end - offset : chunk;
+        want = crc32c (buf + offset, len);
+        /* little endian, as the crypto API gives it */
+        if (out[4 * i] != (want & 0xff) || out[4 * i + 1] != ((want >> 8) & 0xff) ||
+            out[4 * i + 2] != ((want >> 16) & 0xff) || out[4 * i + 3] != (want >> 24)) {
+            fprintf (stderr, "%s: chunk %d at %lld differs, expected %08x\n", what, i,
+                     (long long)offset, want);
+            exit (1);
+        }
+    }
+}
+
+static void expect_count (int got, int want, const char *what) {
+
+    if (got != want) {
+        fprintf (stderr, "%s: got %d digests, expected %d\n", what, got, want);
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    static const unsigned char abc_sha256[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    unsigned char out[MAX_CHUNKS * ASGN1_DIGEST_MAX];
+    struct asgn1_digest req;
+    unsigned char *buf;
+    off_t i, size;
+    int fd, nr;
+
+    if (argc > 1)
+        filename = argv[1];
+
+    if (crc32c ((const unsigned char *)"123456789", 9) != 0xe3069283) {
+        fprintf (stderr, "CRC32C here is broken\n");
+        exit (1);
+    }
+
+    fd = open_empty (filename);
+
+    /* pages 0 and 2 of varied bytes, page 1 a hole, "abc" in page 3 */
+    size = 3 * page + 3;
+    buf = test_alloc (size);
+    for (i = 0; i < page; i++)
+        buf[i] = i * 7 + (i >> 8);
+    expect_pos (pwrite (fd, buf, page, 0), page, "write of page 0");
+    expect_pos (pwrite (fd, buf, page, 2 * page), page, "write of page 2");
+    expect_pos (pwrite (fd, "abc", 3, 3 * page), 3, "write of page 3");
+    expect_pos (pread (fd, buf, size, 0), size, "read of the device");
+
+    /* one digest per page, the last one short */
+    nr = digest (fd, ASGN1_DIGEST_CRC32C, 0, size, page, MAX_CHUNKS, out);
+    expect_count (nr, 4, "per page");
+    expect_crcs (buf, out, nr, 0, size, page, "per page");
+
+    /* one digest over it all, and over ranges running past the end */
+    expect_count (digest (fd, ASGN1_DIGEST_CRC32C, 0, size, 0, 1, out), 1, "whole device");
+    expect_crcs (buf, out, 1, 0, size, size, "whole device");
+    expect_count (digest (fd, ASGN1_DIGEST_CRC32C, page / 2, 1LL << 40, 0, 1, out), 1, "past the end");
+    expect_crcs (buf, out, 1, page / 2, size, size, "past the end");
+
+    /* chunks that don't line up with pages */
+    nr = digest (fd, ASGN1_DIGEST_CRC32C, 100, size - 200, 1000, MAX_CHUNKS, out);
+    expect_count (nr, (size - 200 + 999) / 1000, "unaligned chunks");
+    expect_crcs (buf, out, nr, 100, size - 100, 1000, "unaligned chunks");
+    printf ("CRC32C digests match the data read back\n");
+
+    /* a request that runs out of room is carried on where it stopped */
+    nr = digest (fd, ASGN1_DIGEST_CRC32C, 0, size, page, 3, out);
+    expect_count (nr, 3, "first part");
+    nr = digest (fd, ASGN1_DIGEST_CRC32C, 3 * page, size - 3 * page, page, 3, out + 4 * 3);
+    expect_count (nr, 1, "rest");
+    expect_crcs (buf, out, 4, 0, size, page, "carried on");
+    printf ("digest requests can be carried on\n");
+
+    expect_count (digest (fd, ASGN1_DIGEST_SHA256, 3 * page, 3, 0, 1, out), 1, "SHA-256");
+    if (memcmp (out, abc_sha256, sizeof (abc_sha256)) != 0) {
+        fprintf (stderr, "SHA-256 of \"abc\" differs\n");
+        exit (1);
+    }
+    printf ("SHA-256 digests match\n");
+
+    /* nothing past the end, and bad requests are refused */
+    expect_count (digest (fd, ASGN1_DIGEST_CRC32C, size, page, 0, 1, out), 0, "at the end");
+    req.offset = 0;
+    req.length = size;
+    req.chunk = 0;
+    req.digests = (uintptr_t)out;
+    req.nr = 1;
+    req.algo = 2;
+    expect_errno (ioctl (fd, ASGN1_DIGEST, &req), EINVAL, "digest with an unknown algorithm");
+    req.algo = ASGN1_DIGEST_CRC32C;
+    req.nr = 0;
+    expect_errno (ioctl (fd, ASGN1_DIGEST, &req), EINVAL, "digest into no room");
+    printf ("bad digest requests are refused\n");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
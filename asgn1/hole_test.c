@@ -0,0 +1,70 @@
+/*
+ * Checks that unwritten ranges of an asgn1 device are holes: they read as
+ * zeroes, SEEK_DATA and SEEK_HOLE skip over them page by page, and seeking
+ * past the end and writing there leaves one behind.
+ *
+ * Usage: hole_test [device]
+ */
+
+#include "asgn1_test.h"
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    off_t size, far;
+    char *buf;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* data in pages 3 and 8 only */
+    expect_pos (pwrite (fd, "data", 4, 3 * page + 100), 4, "write to page 3");
+    expect_pos (pwrite (fd, "x", 1, 8 * page), 1, "write to page 8");
+    size = 8 * page + 1;
+    expect_pos (lseek (fd, 0, SEEK_END), size, "SEEK_END");
+
+    buf = test_alloc (size + page);
+    memset (buf, 0xff, size + page);
+    expect_pos (pread (fd, buf, size + page, 0), size, "read of the whole device");
+    expect_zeroes (buf, 0, 3 * page + 100, "hole before page 3");
+    if (memcmp (buf + 3 * page + 100, "data", 4) != 0 || buf[8 * page] != 'x') {
+        fprintf (stderr, "data read back differs from data written\n");
+        exit (1);
+    }
+    expect_zeroes (buf, 3 * page + 104, 8 * page, "hole between pages 3 and 8");
+    printf ("holes read as zeroes\n");
+
+    expect_pos (lseek (fd, 0, SEEK_DATA), 3 * page, "SEEK_DATA from 0");
+    expect_pos (lseek (fd, 3 * page + 50, SEEK_DATA), 3 * page + 50, "SEEK_DATA inside data");
+    expect_pos (lseek (fd, 3 * page, SEEK_HOLE), 4 * page, "SEEK_HOLE from page 3");
+    expect_pos (lseek (fd, 4 * page, SEEK_DATA), 8 * page, "SEEK_DATA from page 4");
+    expect_pos (lseek (fd, 5 * page + 7, SEEK_HOLE), 5 * page + 7, "SEEK_HOLE inside a hole");
+    expect_pos (lseek (fd, 8 * page, SEEK_HOLE), size, "SEEK_HOLE from the last page");
+    expect_errno (lseek (fd, size, SEEK_DATA), ENXIO, "SEEK_DATA at the end");
+    printf ("SEEK_DATA and SEEK_HOLE skip holes\n");
+
+    /* seeking past the end is allowed, reads there find nothing */
+    far = size + 2 * page;
+    expect_pos (lseek (fd, far, SEEK_SET), far, "seek past the end");
+    expect_pos (read (fd, buf, page), 0, "read past the end");
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after seeking past the end");
+
+    /* and a write there leaves a hole behind it */
+    expect_pos (write (fd, "y", 1), 1, "write past the end");
+    expect_pos (lseek (fd, 0, SEEK_END), far + 1, "size after writing past the end");
+    memset (buf, 0xff, 2 * page + 1);
+    expect_pos (pread (fd, buf, 2 * page + 1, size), 2 * page + 1, "read of the new hole");
+    expect_zeroes (buf, 0, 2 * page, "hole left by writing past the end");
+    if (buf[2 * page] != 'y') {
+        fprintf (stderr, "byte written past the end reads back as %d\n", buf[2 * page]);
+        exit (1);
+    }
+    printf ("writing past the end leaves a hole\n");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Checks vectored I/O on an asgn1 device: writev and pwritev scatter many
+ * buffers across page boundaries in one call, and readv and preadv gather
+ * them back through buffers split at other places.
+ *
+ * Usage: iov_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/uio.h>
+
+#define NR_IOV 16
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct iovec iov[NR_IOV];
+    char *data, *buf;
+    size_t size, done, len;
+    off_t start;
+    int fd, i;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* buffers of odd sizes, so most of them straddle a page boundary */
+    size = 5 * page + 123;
+    data = test_alloc (size);
+    buf = test_alloc (size);
+    for (done = 0; done < size; done++)
+        data[done] = done * 13 + (done >> 12);
+    start = page - 77;
+    for (i = 0, done = 0; i < NR_IOV; i++, done += len) {
+        len = i < NR_IOV - 1 ? size / NR_IOV + i * 7 - 50 : size - done;
+        iov[i].iov_base = data + done;
+        iov[i].iov_len = len;
+    }
+    expect_pos (lseek (fd, start, SEEK_SET), start, "seek");
+    expect_pos (writev (fd, iov, NR_IOV), size, "writev");
+    expect_pos (lseek (fd, 0, SEEK_CUR), start + size, "offset after writev");
+
+    /* read back through buffers split differently */
+    for (i = 0, done = 0; i < NR_IOV; i++, done += len) {
+        len = i < NR_IOV - 1 ? (size_t)page / 4 + i * 11 : size - done;
+        iov[i].iov_base = buf + done;
+        iov[i].iov_len = len;
+    }
+    expect_pos (lseek (fd, start, SEEK_SET), start, "seek");
+    expect_pos (readv (fd, iov, NR_IOV), size, "readv");
+    expect_bytes (buf, data, size, "readv after writev");
+    printf ("readv and writev scatter and gather across pages\n");
+
+    /* the same at explicit offsets, and a read running past the end */
+    iov[0].iov_base = data + size / 2;
+    iov[0].iov_len = size / 2;
+    iov[1].iov_base = data;
+    iov[1].iov_len = size / 2;
+    expect_pos (pwritev (fd, iov, 2, 3 * page + 1), 2 * (size / 2), "pwritev");
+    memset (buf, 0xff, size);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = size / 2;
+    iov[1].iov_base = buf + size / 2;
+    iov[1].iov_len = size - size / 2;
+    expect_pos (preadv (fd, iov, 2, 3 * page + 1), 2 * (size / 2), "preadv");
+    expect_bytes (buf, data + size / 2, size / 2, "first half of preadv");
+    expect_bytes (buf + size / 2, data, size / 2, "second half of preadv");
+    printf ("preadv and pwritev work at any offset\n");
+
+    free (data);
+    free (buf);
+    close (fd);
+    return 0;
+}
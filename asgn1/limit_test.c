@@ -0,0 +1,99 @@
+/*
+ * Checks the capacity limit of an asgn1 device: writes stop at the limit
+ * with ENOSPC, what is already held can still be overwritten, and pages can
+ * be marked discardable and kept again. Needs the module loaded with
+ * limit_mib set, test.sh uses 1.
+ *
+ * Usage: limit_test [device]
+ */
+
+#include "asgn1_test.h"
+
+static void set_discardable (int fd, off_t offset, off_t length, int discardable) {
+
+    struct asgn1_discard req;
+
+    memset (&req, 0, sizeof (req));
+    req.offset = offset;
+    req.length = length;
+    req.discardable = discardable;
+    if (ioctl (fd, ASGN1_DISCARDABLE, &req) < 0) {
+        fprintf (stderr, "ASGN1_DISCARDABLE of %lld bytes at %lld failed:  %s\n",
+                 (long long)length, (long long)offset, strerror (errno));
+        exit (1);
+    }
+}
+
+static void expect_discardable (int fd, unsigned long long want, const char *what) {
+
+    struct asgn1_stats stats;
+
+    get_stats (fd, &stats);
+    if (stats.discardable_pages != want) {
+        fprintf (stderr, "%s: %llu pages discardable, expected %llu\n", what,
+                 (unsigned long long)stats.discardable_pages, want);
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_stats stats;
+    off_t limit;
+    char *buf;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+    get_stats (fd, &stats);
+    limit = stats.limit_bytes;
+    if (limit == 0 || limit % page != 0) {
+        fprintf (stderr, "device limit is %lld bytes, load the module with limit_mib\n", (long long)limit);
+        exit (1);
+    }
+
+    /* a write running past the limit stops there, and the next one fails */
+    buf = test_alloc (limit + 2 * page);
+    memset (buf, 'l', limit + 2 * page);
+    expect_pos (pwrite (fd, buf, limit + 2 * page, 0), limit, "write past the limit");
+    expect_errno (pwrite (fd, buf, 1, limit), ENOSPC, "write at the limit");
+    expect_errno (pwrite (fd, buf, 1, limit + 5 * page), ENOSPC, "write into a hole at the limit");
+    expect_pos (lseek (fd, 0, SEEK_END), limit, "size at the limit");
+    get_stats (fd, &stats);
+    if ((off_t)stats.num_pages * page != limit) {
+        fprintf (stderr, "device holds %llu pages at a limit of %lld bytes\n",
+                 (unsigned long long)stats.num_pages, (long long)limit);
+        exit (1);
+    }
+    printf ("writes stop at the limit with ENOSPC\n");
+
+    /* whatever is held can still be written */
+    expect_pos (pwrite (fd, "over", 4, limit - 2), 4 - 2, "overwrite at the end");
+    expect_pos (pwrite (fd, "over", 4, page - 2), 4, "overwrite across pages");
+    expect_pos (pread (fd, buf, 4, page - 2), 4, "read of the overwrite");
+    expect_bytes (buf, "over", 4, "overwrite at the limit");
+    printf ("pages held can be overwritten at the limit\n");
+
+    /* pages can be marked discardable and kept again */
+    set_discardable (fd, page, 3 * page, 1);
+    expect_discardable (fd, 3, "after marking three pages");
+    set_discardable (fd, 2 * page, page, 0);
+    expect_discardable (fd, 2, "after keeping one again");
+    set_discardable (fd, 0, limit, 0);
+    expect_discardable (fd, 0, "after keeping them all");
+
+    /* a read-only fd may not */
+    close (fd);
+    fd = open_device (filename, O_RDONLY);
+    expect_errno (ioctl (fd, ASGN1_DISCARDABLE, &(struct asgn1_discard){ 0, page, 1, 0 }), EBADF,
+                  "ASGN1_DISCARDABLE on a read-only fd");
+    expect_discardable (fd, 0, "after a refused request");
+    printf ("discardable pages are counted\n");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
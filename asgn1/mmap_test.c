@@ -10,9 +10,7 @@
 #include <malloc.h>
 
 //#define MMAP_DEV_CMD_GET_BUFSIZE 1  /* defines our IOCTL cmd */
-#define MYIOC_TYPE 'k'
-#define SET_NPROC_OP 1
-#define ASGN1_SET_NPROC _IOW(MYIOC_TYPE, SET_NPROC_OP, sizeof(int)) 
+#include "asgn1_ioctl.h"
 
 
 
@@ -91,7 +89,7 @@ int main (int argc, char **argv) {
 
     unsigned long i, j;
     int fd;
-    char *buf, *read_buf, *mmap_buf, *filename = "/dev/asgn1";
+    char *buf, *read_buf, *mmap_buf, *filename = "/dev/asgn10";
     int nproc = 12345;
 
     srandom (getpid ());
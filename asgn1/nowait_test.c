@@ -0,0 +1,81 @@
+/*
+ * Checks RWF_NOWAIT reads and writes on an asgn1 device: a write into pages
+ * already there goes through, even one growing the device within its last
+ * page, while one that needs a new page, past the end or in a hole, fails
+ * with EAGAIN and changes nothing. Reads never need to wait for a page on a
+ * device loaded with the default module parameters.
+ *
+ * Usage: nowait_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/uio.h>
+
+static ssize_t nowait_write (int fd, const char *data, size_t len, off_t offset) {
+
+    struct iovec iov = { (void *)data, len };
+
+    return pwritev2 (fd, &iov, 1, offset, RWF_NOWAIT);
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_stats stats;
+    unsigned long long again;
+    struct iovec iov;
+    off_t size;
+    char *buf;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* pages 0 to 2, then a hole up to page 6 */
+    size = 2 * page + 100;
+    buf = test_alloc (8 * page);
+    memset (buf, 'a', size);
+    expect_pos (pwrite (fd, buf, size, 0), size, "write of pages 0 to 2");
+    expect_pos (pwrite (fd, "x", 1, 6 * page), 1, "write to page 6");
+    size = 6 * page + 1;
+    get_stats (fd, &stats);
+    again = stats.nowait_again;
+
+    expect_pos (nowait_write (fd, "inside", 6, page - 3), 6, "nowait write across pages 0 and 1");
+    expect_pos (nowait_write (fd, "grow", 4, 6 * page + 1), 4, "nowait write growing page 6");
+    size += 4;
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after growing within a page");
+    printf ("nowait writes to pages already there go through\n");
+
+    expect_errno (nowait_write (fd, "new", 3, 7 * page), EAGAIN, "nowait write past the last page");
+    expect_errno (nowait_write (fd, "hole", 4, 4 * page), EAGAIN, "nowait write into a hole");
+    expect_errno (nowait_write (fd, "span", 4, 3 * page - 2), EAGAIN, "nowait write running into a hole");
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after refused writes");
+    expect_pos (lseek (fd, 3 * page, SEEK_HOLE), 3 * page, "hole after refused writes");
+    get_stats (fd, &stats);
+    if (stats.nowait_again != again + 3) {
+        fprintf (stderr, "%llu nowait calls returned EAGAIN, expected 3\n", stats.nowait_again - again);
+        exit (1);
+    }
+    printf ("nowait writes needing a new page return EAGAIN\n");
+
+    /* reads, holes included, never wait */
+    memset (buf, 0xff, 8 * page);
+    iov.iov_base = buf;
+    iov.iov_len = 8 * page;
+    expect_pos (preadv2 (fd, &iov, 1, 0, RWF_NOWAIT), size, "nowait read of the device");
+    expect_bytes (buf + page - 3, "inside", 6, "nowait write across pages");
+    expect_zeroes (buf, 3 * page, 6 * page, "hole read without waiting");
+    expect_bytes (buf + 6 * page, "xgrow", 5, "nowait write growing the device");
+    printf ("nowait reads go through\n");
+
+    /* and the refused writes go through without RWF_NOWAIT */
+    expect_pos (pwrite (fd, "new", 3, 7 * page), 3, "write past the last page");
+    expect_pos (pwrite (fd, "hole", 4, 4 * page), 4, "write into a hole");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
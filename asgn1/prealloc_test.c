@@ -0,0 +1,102 @@
+/*
+ * Checks ASGN1_PREALLOC on an asgn1 device: it allocates every page of the
+ * range, keeping data already there and reading zeroes elsewhere, grows the
+ * device to cover the range unless asked not to, zeroes the range only when
+ * asked to, and refuses requests it doesn't understand.
+ *
+ * Usage: prealloc_test [device]
+ */
+
+#include "asgn1_test.h"
+
+static void prealloc (int fd, off_t offset, off_t length, __u32 flags) {
+
+    struct asgn1_prealloc req;
+
+    req.offset = offset;
+    req.length = length;
+    req.flags = flags;
+    req.node = -1;
+    if (ioctl (fd, ASGN1_PREALLOC, &req) < 0) {
+        fprintf (stderr, "prealloc of %lld bytes at %lld failed:  %s\n",
+                 (long long)length, (long long)offset, strerror (errno));
+        exit (1);
+    }
+}
+
+static void expect_pages (int fd, unsigned long long want, const char *what) {
+
+    struct asgn1_stats stats;
+
+    get_stats (fd, &stats);
+    if (stats.num_pages != want) {
+        fprintf (stderr, "%s: device holds %llu pages, expected %llu\n", what,
+                 (unsigned long long)stats.num_pages, want);
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_prealloc req;
+    off_t size;
+    char *buf;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* pages 0 to 4, around a few bytes already in page 1 */
+    expect_pos (pwrite (fd, "keep", 4, page + 10), 4, "write to page 1");
+    expect_pages (fd, 1, "after writing");
+    size = page / 2 + 4 * page;
+    prealloc (fd, page / 2, 4 * page, 0);
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after prealloc");
+    expect_pages (fd, 5, "after prealloc");
+    buf = test_alloc (size);
+    memset (buf, 0xff, size);
+    expect_pos (pread (fd, buf, size, 0), size, "read after prealloc");
+    expect_zeroes (buf, 0, page + 10, "range before the data");
+    expect_bytes (buf + page + 10, "keep", 4, "data in the range");
+    expect_zeroes (buf, page + 14, size, "range after the data");
+    expect_pos (lseek (fd, 0, SEEK_DATA), 0, "SEEK_DATA after prealloc");
+    expect_pos (lseek (fd, 0, SEEK_HOLE), size, "SEEK_HOLE after prealloc");
+    printf ("prealloc allocates the range, keeping its data\n");
+
+    /* past the end without growing the device */
+    prealloc (fd, 10 * page, 2 * page, ASGN1_PREALLOC_KEEP_SIZE);
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after prealloc keeping it");
+    expect_pages (fd, 7, "after prealloc keeping the size");
+    printf ("prealloc keeps the size if asked to\n");
+
+    /* zeroing just one byte of the data */
+    prealloc (fd, page + 12, 1, ASGN1_PREALLOC_ZERO | ASGN1_PREALLOC_KEEP_SIZE);
+    expect_pos (pread (fd, buf, 4, page + 10), 4, "read after zeroing");
+    expect_bytes (buf, "ke\0p", 4, "data after zeroing a byte of it");
+    expect_pages (fd, 7, "after zeroing");
+    printf ("prealloc zeroes the range if asked to\n");
+
+    req.offset = 0;
+    req.length = page;
+    req.flags = 0x80;
+    req.node = -1;
+    expect_errno (ioctl (fd, ASGN1_PREALLOC, &req), EINVAL, "prealloc with unknown flags");
+    req.flags = 0;
+    req.length = 0;
+    expect_errno (ioctl (fd, ASGN1_PREALLOC, &req), EINVAL, "prealloc of nothing");
+
+    /* a read-only fd may not */
+    close (fd);
+    fd = open_device (filename, O_RDONLY);
+    req.length = page;
+    expect_errno (ioctl (fd, ASGN1_PREALLOC, &req), EBADF, "prealloc on a read-only fd");
+    expect_pages (fd, 7, "after refused requests");
+    printf ("bad prealloc requests are refused\n");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
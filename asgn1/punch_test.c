@@ -0,0 +1,136 @@
+/*
+ * Checks ASGN1_PUNCH_HOLE and ASGN1_TRUNCATE on an asgn1 device loaded with
+ * the default module parameters: punching frees the pages wholly inside the
+ * range, zeroes the ends of the pages it only partly covers and keeps the
+ * size, and truncating frees the pages past the new end, zeroing the rest of
+ * the last page so growing the device again reads zeroes there.
+ *
+ * Usage: punch_test [device]
+ */
+
+#include "asgn1_test.h"
+
+static void expect_pages (int fd, unsigned long long want, const char *what) {
+
+    struct asgn1_stats stats;
+
+    get_stats (fd, &stats);
+    if (stats.num_pages != want) {
+        fprintf (stderr, "%s: device holds %llu pages, expected %llu\n", what,
+                 (unsigned long long)stats.num_pages, want);
+        exit (1);
+    }
+}
+
+/* Checks that bytes [from, to) of buf are c, the fill of the page they are in, or zero. */
+static void expect_fill (const char *buf, size_t from, size_t to, off_t page, int zero, const char *what) {
+
+    size_t i;
+    int want;
+
+    for (i = from; i < to; i++) {
+        want = zero ? 0 : 'a' + (int)(i / page);
+        if (buf[i] != want) {
+            fprintf (stderr, "%s: byte %zu is %d, expected %d\n", what, i, buf[i], want);
+            exit (1);
+        }
+    }
+}
+
+static void punch (int fd, off_t offset, off_t length) {
+
+    struct asgn1_range range;
+
+    range.offset = offset;
+    range.length = length;
+    if (ioctl (fd, ASGN1_PUNCH_HOLE, &range) < 0) {
+        fprintf (stderr, "punch of %lld bytes at %lld failed:  %s\n",
+                 (long long)length, (long long)offset, strerror (errno));
+        exit (1);
+    }
+}
+
+static void truncate_device (int fd, __u64 size) {
+
+    if (ioctl (fd, ASGN1_TRUNCATE, &size) < 0) {
+        fprintf (stderr, "truncate to %llu failed:  %s\n", (unsigned long long)size, strerror (errno));
+        exit (1);
+    }
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_range range;
+    off_t i, size, end;
+    char *buf;
+    int fd;
+
+    if (argc > 1)
+        filename = argv[1];
+
+    fd = open_empty (filename);
+
+    /* eight pages, each filled with its own letter */
+    size = 8 * page;
+    buf = test_alloc (size);
+    for (i = 0; i < 8; i++)
+        memset (buf + i * page, 'a' + i, page);
+    expect_pos (pwrite (fd, buf, size, 0), size, "write of eight pages");
+    expect_pages (fd, 8, "after writing");
+
+    /* pages 2 and 3 go, and the ends of pages 1 and 4 are zeroed */
+    punch (fd, page + 100, 3 * page + 100);
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after punching");
+    expect_pages (fd, 6, "after punching");
+    memset (buf, 0xff, size);
+    expect_pos (pread (fd, buf, size, 0), size, "read after punching");
+    expect_fill (buf, 0, page + 100, page, 0, "data before the hole");
+    expect_fill (buf, page + 100, 4 * page + 200, page, 1, "punched hole");
+    expect_fill (buf, 4 * page + 200, size, page, 0, "data after the hole");
+    expect_pos (lseek (fd, 0, SEEK_HOLE), 2 * page, "SEEK_HOLE after punching");
+    expect_pos (lseek (fd, 2 * page, SEEK_DATA), 4 * page, "SEEK_DATA after punching");
+    printf ("punching frees whole pages and zeroes partial ones\n");
+
+    /* punching a hole again, or past the end, changes nothing */
+    punch (fd, 2 * page, 2 * page);
+    punch (fd, 16 * page, page);
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after punching past the end");
+    expect_pages (fd, 6, "after punching holes");
+
+    range.offset = 0;
+    range.length = 0;
+    expect_errno (ioctl (fd, ASGN1_PUNCH_HOLE, &range), EINVAL, "punch of nothing");
+
+    /* page 7 goes and the rest of page 6 is zeroed */
+    end = 6 * page + 10;
+    truncate_device (fd, end);
+    expect_pos (lseek (fd, 0, SEEK_END), end, "size after truncating");
+    expect_pages (fd, 5, "after truncating");
+    expect_pos (pread (fd, buf, page, end), 0, "read past the new end");
+
+    /* growing again leaves zeroes, not the old data, and allocates nothing */
+    truncate_device (fd, size);
+    expect_pos (lseek (fd, 0, SEEK_END), size, "size after growing");
+    expect_pages (fd, 5, "after growing");
+    memset (buf, 0xff, size);
+    expect_pos (pread (fd, buf, size, 0), size, "read after growing");
+    expect_fill (buf, 4 * page + 200, end, page, 0, "data kept by the truncate");
+    expect_fill (buf, end, size, page, 1, "tail cut by the truncate");
+    printf ("truncating frees the tail and growing reads zeroes\n");
+
+    /* a read-only fd may do neither */
+    close (fd);
+    fd = open_device (filename, O_RDONLY);
+    range.offset = 0;
+    range.length = page;
+    expect_errno (ioctl (fd, ASGN1_PUNCH_HOLE, &range), EBADF, "punch on a read-only fd");
+    expect_errno (ioctl (fd, ASGN1_TRUNCATE, &(__u64){ 0 }), EBADF, "truncate on a read-only fd");
+    expect_pages (fd, 5, "after refused ioctls");
+    printf ("read-only fds can't punch or truncate\n");
+
+    free (buf);
+    close (fd);
+    return 0;
+}
@@ -29,7 +29,7 @@
 int main(int argc, char *argv[])
 {
 	int length = 20, position = 0, fd, rc;
-	char *message, *nodename = "/dev/asgn1";
+	char *message, *nodename = "/dev/asgn10";
 
 	if (argc > 1)
 		nodename = argv[1];
@@ -0,0 +1,121 @@
+/*
+ * Checks that an ASGN1_SNAPSHOT of an asgn1 device keeps reading back the
+ * device as it was when taken, whatever is later done to the device, and
+ * that a later snapshot sees what was done.
+ *
+ * Usage: snapshot_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/mman.h>
+
+static int snapshot (int fd) {
+
+    int snap;
+
+    if ((snap = ioctl (fd, ASGN1_SNAPSHOT)) < 0) {
+        fprintf (stderr, "snapshot failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    return snap;
+}
+
+/* Checks that fd reads back as want, size bytes long. */
+static void expect_contents (int fd, const char *want, off_t size, const char *what) {
+
+    char *buf = test_alloc (size + 1);
+
+    expect_pos (lseek (fd, 0, SEEK_END), size, what);
+    expect_pos (pread (fd, buf, size + 1, 0), size, what);
+    expect_bytes (buf, want, size, what);
+    free (buf);
+}
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    struct asgn1_range range;
+    char *before, *after, *map;
+    off_t i, size;
+    int fd, snap, snap2;
+
+    if (argc > 1)
+        filename = argv[1];
+
+    fd = open_empty (filename);
+
+    /* pages 0 to 3 and 5 filled with their own letter, page 4 a hole */
+    size = 6 * page;
+    before = test_alloc (8 * page);
+    after = test_alloc (8 * page);
+    for (i = 0; i < 6; i++) {
+        if (i != 4)
+            memset (before + i * page, 'a' + i, page);
+    }
+    expect_pos (pwrite (fd, before, 4 * page, 0), 4 * page, "write of pages 0 to 3");
+    expect_pos (pwrite (fd, before + 5 * page, page, 5 * page), page, "write of page 5");
+
+    /* page 3 is mapped writable before the snapshot is taken */
+    map = mmap (NULL, 8 * page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap()");
+        exit (1);
+    }
+    map[3 * page] = 'd';
+
+    snap = snapshot (fd);
+    expect_contents (snap, before, size, "new snapshot");
+
+    /* change every page of the device some way */
+    memcpy (after, before, size);
+    expect_pos (pwrite (fd, "xyz", 3, page + 10), 3, "write into page 1");
+    memcpy (after + page + 10, "xyz", 3);
+    range.offset = 2 * page;
+    range.length = page;
+    if (ioctl (fd, ASGN1_PUNCH_HOLE, &range) < 0) {
+        fprintf (stderr, "punch failed:  %s\n", strerror (errno));
+        exit (1);
+    }
+    memset (after + 2 * page, 0, page);
+    map[3 * page + 1] = 'M';
+    after[3 * page + 1] = 'M';
+    expect_pos (pwrite (fd, "hole", 4, 4 * page), 4, "write into the hole");
+    memcpy (after + 4 * page, "hole", 4);
+    expect_pos (pwrite (fd, "end", 3, 7 * page), 3, "write past the end");
+    memcpy (after + 7 * page, "end", 3);
+
+    expect_contents (fd, after, 7 * page + 3, "device after the changes");
+    expect_contents (snap, before, size, "snapshot after the changes");
+    printf ("a snapshot keeps its pages when the device changes\n");
+
+    /* a second snapshot sees the changes, the first still doesn't */
+    snap2 = snapshot (fd);
+    expect_pos (pwrite (fd, "again", 5, 0), 5, "write after the second snapshot");
+    expect_contents (snap2, after, 7 * page + 3, "second snapshot");
+    expect_contents (snap, before, size, "first snapshot after the second");
+    close (snap2);
+
+    /* reading a snapshot into a mapping of the device itself */
+    expect_pos (pread (snap, map + 6 * page, page, 5 * page), page, "snapshot read into a mapping");
+    expect_bytes (map + 6 * page, before + 5 * page, page, "snapshot read into a mapping");
+    printf ("snapshots can be read into a mapping of the device\n");
+
+    /* a snapshot can't be written, and outlives emptying the device */
+    expect_pos (write (snap, "x", 1), -1, "write to a snapshot");
+    munmap (map, 8 * page);
+    close (fd);
+    close (open_device (filename, O_WRONLY));
+    expect_contents (snap, before, size, "snapshot after emptying the device");
+    printf ("a snapshot outlives emptying the device\n");
+
+    /* a read-only fd may not take one */
+    fd = open_device (filename, O_RDONLY);
+    expect_errno (ioctl (fd, ASGN1_SNAPSHOT), EBADF, "snapshot on a read-only fd");
+    close (fd);
+
+    close (snap);
+    free (before);
+    free (after);
+    return 0;
+}
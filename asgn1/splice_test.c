@@ -0,0 +1,79 @@
+/*
+ * Checks splice and sendfile on an asgn1 device: sendfile copies the device
+ * out to a file, from any offset and across holes, and splice fills the
+ * device from a pipe, and what comes back matches what went in.
+ *
+ * Usage: splice_test [device]
+ */
+
+#include "asgn1_test.h"
+#include <sys/sendfile.h>
+
+int main (int argc, char **argv) {
+
+    char *filename = TEST_DEVICE;
+    off_t page = sysconf (_SC_PAGESIZE);
+    char *data, *buf;
+    off_t size, offset, done;
+    loff_t pos;
+    int fd, out, pipefd[2];
+    ssize_t len;
+
+    if (argc > 1)
+        filename = argv[1];
+    fd = open_empty (filename);
+
+    /* pages 0, 1 and 3 of data, page 2 a hole, a short last page */
+    size = 4 * page + 500;
+    data = test_alloc (size);
+    buf = test_alloc (size);
+    for (done = 0; done < size; done++)
+        data[done] = done * 31 + (done >> 12);
+    memset (data + 2 * page, 0, page);
+    expect_pos (pwrite (fd, data, 2 * page, 0), 2 * page, "write of pages 0 and 1");
+    expect_pos (pwrite (fd, data + 3 * page, size - 3 * page, 3 * page), size - 3 * page,
+                "write of pages 3 and 4");
+
+    /* out to a file, in one call and then from an unaligned offset */
+    if ((out = fileno (tmpfile ())) < 0) {
+        perror ("tmpfile()");
+        exit (1);
+    }
+    offset = 0;
+    expect_pos (sendfile (out, fd, &offset, size + page), size, "sendfile of the device");
+    expect_pos (offset, size, "offset after sendfile");
+    expect_pos (pread (out, buf, size, 0), size, "read of the file");
+    expect_bytes (buf, data, size, "file sent from the device");
+    offset = page + 99;
+    expect_pos (sendfile (out, fd, &offset, size), size - (page + 99), "sendfile from an offset");
+    expect_pos (pread (out, buf, size - (page + 99), size), size - (page + 99), "read of the file");
+    expect_bytes (buf, data + page + 99, size - (page + 99), "file sent from an offset");
+    printf ("sendfile copies the device out\n");
+
+    /* in from a pipe, at an unaligned offset past the end */
+    if (pipe (pipefd) < 0) {
+        perror ("pipe()");
+        exit (1);
+    }
+    pos = size + 10;
+    for (done = 0; done < 2 * page; done += len) {
+        expect_pos (write (pipefd[1], data + done, page), page, "write to the pipe");
+        len = splice (pipefd[0], NULL, fd, &pos, page, 0);
+        expect_pos (len, page, "splice into the device");
+    }
+    expect_pos (pos, size + 10 + 2 * page, "offset after splicing");
+    memset (buf, 0xff, 2 * page);
+    expect_pos (pread (fd, buf, 2 * page, size + 10), 2 * page, "read of the spliced data");
+    expect_bytes (buf, data, 2 * page, "data spliced into the device");
+    expect_pos (pread (fd, buf, 10, size), 10, "read of the gap");
+    expect_zeroes (buf, 0, 10, "gap before the spliced data");
+    printf ("splice fills the device from a pipe\n");
+
+    free (data);
+    free (buf);
+    close (pipefd[0]);
+    close (pipefd[1]);
+    close (out);
+    close (fd);
+    return 0;
+}
@@ -1,4 +1,37 @@
 #!/bin/bash
-cat asgn1.c > /dev/asgn1
-cat /dev/asgn1 > output.txt
+cat asgn1.c > /dev/asgn10
+cat /dev/asgn10 > output.txt
 diff asgn1.c output.txt
+./hole_test
+./iov_test
+./splice_test
+./prealloc_test
+./snapshot_test
+./nowait_test
+./punch_test
+./digest_test
+
+# the rest need module parameters, the module is reloaded with them
+reload () {
+    sudo rmmod asgn1
+    sudo insmod ./asgn1.ko "$@"
+    sudo chmod 777 /dev/asgn1[0-9]*
+}
+reload compress_secs=1
+./compress_test
+reload dedup=1
+./dedup_test
+reload backing=/tmp/asgn1_test
+./backing_test save
+reload backing=/tmp/asgn1_test
+./backing_test restore
+reload backing=/tmp/asgn1_test flush_secs=60
+./backing_test grow
+reload backing=/tmp/asgn1_test
+./backing_test grown
+reload limit_mib=1
+./limit_test
+reload checksum=1 scrub_secs=1
+./crc_test
+reload
+sudo rm -f /tmp/asgn1_test.*